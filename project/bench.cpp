@@ -0,0 +1,56 @@
+#include "bench.h"
+
+#include <chrono>
+#include <stdio.h>
+#include <string.h>
+#include <utility>
+
+std::vector<Benchmark>& benchmarks() {
+	static std::vector<Benchmark> all;
+	return all;
+}
+
+// the figures reported by the run of the benchmark in progress
+static std::vector<std::pair<const char*, double>>& metrics() {
+	static std::vector<std::pair<const char*, double>> reported;
+	return reported;
+}
+
+void reportMetric(const char* name, double value) {
+	for (auto& metric : metrics()) {
+		if (strcmp(metric.first, name) == 0) {
+			metric.second = value;
+			return;
+		}
+	}
+	metrics().push_back({ name, value });
+}
+
+// runs every benchmark (or only those whose name contains argv[1]),
+// doubling the iteration count until a run takes at least MIN_SECONDS
+int main(int argc, char** argv) {
+	const double MIN_SECONDS = 0.5;
+	for (const auto& benchmark : benchmarks()) {
+		if (argc > 1 && strstr(benchmark.name, argv[1]) == nullptr) {
+			continue;
+		}
+		long iterations = 1;
+		double seconds = 0;
+		while (true) {
+			metrics().clear();
+			auto start = std::chrono::steady_clock::now();
+			benchmark.run(iterations);
+			seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+			if (seconds >= MIN_SECONDS || iterations >= (1L << 30)) {
+				break;
+			}
+			iterations *= 2;
+		}
+		printf("%-32s %12ld iterations %14.1f ns/iteration\n", benchmark.name, iterations, seconds * 1e9 / double(iterations));
+		for (const auto& metric : metrics()) {
+			printf("  %-30s %12.1f\n", metric.first, metric.second);
+		}
+		fflush(stdout);
+	}
+	return 0;
+}
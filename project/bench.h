@@ -0,0 +1,35 @@
+#pragma once
+
+// Minimal benchmark harness for the *.bench.cpp files (runner in bench.cpp).
+// A benchmark runs its body `iterations` times, the runner picks the count and reports the time per iteration:
+//
+// BENCHMARK(splitting) {
+// 	for (long i = 0; i < iterations; ++i)
+// 		splitString("ls -l | head");
+// }
+
+#include <vector>
+
+struct Benchmark
+{
+	const char* name;
+	void (*run)(long iterations);
+};
+
+std::vector<Benchmark>& benchmarks();
+
+// Reports another figure of the run besides its time (like a latency or a peak RSS), printed
+// below the benchmark. Reporting the same name again replaces the value.
+void reportMetric(const char* name, double value);
+
+struct BenchmarkRegistration
+{
+	BenchmarkRegistration(const char* name, void (*run)(long)) {
+		benchmarks().push_back({ name, run });
+	}
+};
+
+#define BENCHMARK(name) \
+	static void name(long iterations); \
+	static BenchmarkRegistration name##Registration(#name, name); \
+	static void name(long iterations)
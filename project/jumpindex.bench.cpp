@@ -0,0 +1,53 @@
+#include "bench.h"
+
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "jumpindex.h"
+
+using namespace std;
+
+namespace {
+
+volatile size_t sink;
+
+const char* JUMP_BENCH_FILE = "/tmp/shell-jumpindex-bench";
+const char* JUMP_BENCH_DIR = "/tmp/shell-jumpindex-bench-dir";
+
+// an index of 100k directories (that don't exist) and one that does, which is visited the most
+JumpIndex& index100k() {
+	static JumpIndex* index = nullptr;
+	if (index == nullptr) {
+		unlink(JUMP_BENCH_FILE);
+		mkdir(JUMP_BENCH_DIR, 0700);
+		index = new JumpIndex(JUMP_BENCH_FILE);
+		for (int i = 0; i < 100000; ++i)
+			index->record("/home/user/projects/project" + to_string(i) + "/src/dir" + to_string(i % 100));
+		for (int i = 0; i < 50; ++i)
+			index->record(JUMP_BENCH_DIR);
+	}
+	return *index;
+}
+
+// worst case: every directory matches 'dir' and has to be ranked
+BENCHMARK(jumpFindAllMatch100k) {
+	JumpIndex& index = index100k();
+	for (long i = 0; i < iterations; ++i)
+		sink = index.find("dir").size();
+}
+
+// the character masks rule out every directory
+BENCHMARK(jumpFindNoMatch100k) {
+	JumpIndex& index = index100k();
+	for (long i = 0; i < iterations; ++i)
+		sink = index.find("qxz").size();
+}
+
+BENCHMARK(jumpRecord100k) {
+	JumpIndex& index = index100k();
+	for (long i = 0; i < iterations; ++i)
+		sink = index.record(JUMP_BENCH_DIR);
+}
+
+}
@@ -0,0 +1,508 @@
+#include "jumpindex.h"
+
+#include <algorithm>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+
+// The file is laid out as
+//   Header | masks[capacity] | entries[capacity] | slots[2 * capacity] | strings[stringCapacity]
+// masks sit apart from the entries, so a lookup only has to scan 8 bytes per directory to skip the ones that
+// can't match. slots is an open addressing hash table from a path to its entry (index + 1, 0 is empty).
+
+const char JUMP_MAGIC[8] = "shjump1";
+const uint32_t INITIAL_CAPACITY = 1024;
+const uint32_t INITIAL_STRING_CAPACITY = 64 * 1024;
+// Once the ranks add up to this much, all of them are multiplied by AGING_FACTOR and the directories
+// that drop below MIN_RANK are forgotten, so directories that aren't visited anymore fade out.
+const double AGING_RANK = 200000;
+const double AGING_FACTOR = 0.9;
+const double MIN_RANK = 0.5;
+// how many of the best matches find() tries before it looks again, when they turn out to be gone
+const size_t FIND_CANDIDATES = 8;
+
+struct JumpIndex::Header
+{
+	char magic[8];
+	uint32_t count;
+	uint32_t capacity; // a power of two
+	uint32_t stringBytes; // used bytes of the string area, including garbage
+	uint32_t stringCapacity;
+	uint32_t garbageBytes; // bytes of the paths of removed entries
+	uint32_t padding;
+	double totalRank;
+	char reserved[24];
+};
+
+struct JumpIndex::Entry
+{
+	uint32_t hash;
+	uint32_t offset; // of the path in the string area
+	uint32_t length;
+	uint32_t lastVisit; // seconds since the epoch
+	double rank; // number of visits, aged (see AGING_RANK)
+};
+
+struct JumpIndex::Candidate
+{
+	uint32_t index;
+	int quality; // 2: in the last component, 1: elsewhere in the path, 0: scattered characters
+	double score;
+	uint32_t length;
+
+	bool operator<(const Candidate& other) const {
+		if (quality != other.quality) {
+			return quality > other.quality;
+		}
+		if (score != other.score) {
+			return score > other.score;
+		}
+		return length < other.length;
+	}
+};
+
+size_t JumpIndex::fileSize(uint32_t capacity, uint32_t stringCapacity) {
+	return sizeof(Header) + size_t(capacity) * (sizeof(uint64_t) + sizeof(Entry) + 2 * sizeof(uint32_t))
+		+ stringCapacity;
+}
+
+// FNV-1a
+static uint32_t hashPath(const char* path, size_t length) {
+	uint32_t hash = 2166136261u;
+	for (size_t i = 0; i < length; i++) {
+		hash = (hash ^ uint8_t(path[i])) * 16777619u;
+	}
+	return hash;
+}
+
+static inline char lowerCase(char c) {
+	return c >= 'A' && c <= 'Z' ? char(c - 'A' + 'a') : c;
+}
+
+// one bit per letter and digit (ignoring case), the other characters share the rest
+static uint64_t characterBit(char c) {
+	unsigned char u = uint8_t(lowerCase(c));
+	if (u >= 'a' && u <= 'z') {
+		return uint64_t(1) << (u - 'a');
+	}
+	if (u >= '0' && u <= '9') {
+		return uint64_t(1) << (26 + u - '0');
+	}
+	return uint64_t(1) << (36 + u % 28);
+}
+
+static uint64_t characterMask(const char* text, size_t length) {
+	uint64_t mask = 0;
+	for (size_t i = 0; i < length; i++) {
+		mask |= characterBit(text[i]);
+	}
+	return mask;
+}
+
+// whether the characters of fragment (lower case) appear in text in the same order, ignoring case
+static bool matchesScattered(const char* text, size_t length, const string& fragment) {
+	size_t j = 0;
+	for (size_t i = 0; i < length && j < fragment.size(); i++) {
+		if (lowerCase(text[i]) == fragment[j]) {
+			j++;
+		}
+	}
+	return j == fragment.size();
+}
+
+// whether fragment (lower case) appears in text as a whole, ignoring case
+static bool contains(const char* text, size_t length, const string& fragment) {
+	for (size_t i = 0; i + fragment.size() <= length; i++) {
+		size_t j = 0;
+		while (j < fragment.size() && lowerCase(text[i + j]) == fragment[j]) {
+			j++;
+		}
+		if (j == fragment.size()) {
+			return true;
+		}
+	}
+	return false;
+}
+
+// visits weighted by how long ago the last one was
+static double frecency(double rank, uint32_t lastVisit, time_t now) {
+	long age = long(now) - long(lastVisit);
+	if (age < 3600) {
+		return rank * 4;
+	}
+	if (age < 24 * 3600) {
+		return rank * 2;
+	}
+	if (age < 7 * 24 * 3600) {
+		return rank / 2;
+	}
+	return rank / 4;
+}
+
+JumpIndex::JumpIndex(const string& file) {
+	fd = open(file.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+}
+
+JumpIndex::~JumpIndex() {
+	if (data != nullptr) {
+		munmap(data, mapped);
+	}
+	if (fd >= 0) {
+		close(fd);
+	}
+}
+
+JumpIndex::Header* JumpIndex::header() {
+	return reinterpret_cast<Header*>(data);
+}
+
+uint64_t* JumpIndex::masks() {
+	return reinterpret_cast<uint64_t*>(data + sizeof(Header));
+}
+
+JumpIndex::Entry* JumpIndex::entries() {
+	return reinterpret_cast<Entry*>(masks() + header()->capacity);
+}
+
+uint32_t* JumpIndex::slots() {
+	return reinterpret_cast<uint32_t*>(entries() + header()->capacity);
+}
+
+char* JumpIndex::strings() {
+	return reinterpret_cast<char*>(slots() + 2 * header()->capacity);
+}
+
+// (re)maps the file when another process (or this one) resized it
+bool JumpIndex::mapFile() {
+	struct stat st;
+	if (fstat(fd, &st) < 0) {
+		return false;
+	}
+	if (data != nullptr && size_t(st.st_size) == mapped) {
+		return true;
+	}
+	if (data != nullptr) {
+		munmap(data, mapped);
+		data = nullptr;
+		mapped = 0;
+	}
+	if (st.st_size == 0) {
+		return true;
+	}
+	void* map = mmap(NULL, size_t(st.st_size), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		return false;
+	}
+	data = static_cast<char*>(map);
+	mapped = size_t(st.st_size);
+	return true;
+}
+
+// Takes the lock (LOCK_SH to read, LOCK_EX to change) and maps the current file.
+// An empty or damaged file is initialized under LOCK_EX, and can't be read otherwise.
+bool JumpIndex::lock(int operation) {
+	if (fd < 0) {
+		return false;
+	}
+	while (flock(fd, operation) < 0) {
+		if (errno != EINTR) {
+			return false;
+		}
+	}
+	if (!mapFile()) {
+		unlock();
+		return false;
+	}
+	bool valid = mapped >= sizeof(Header) && memcmp(header()->magic, JUMP_MAGIC, sizeof(JUMP_MAGIC)) == 0
+		&& mapped == fileSize(header()->capacity, header()->stringCapacity)
+		&& header()->count <= header()->capacity && header()->stringBytes <= header()->stringCapacity;
+	if (!valid) {
+		if (operation != LOCK_EX) {
+			unlock();
+			return false;
+		}
+		// nothing worth keeping in there, start over
+		if (data != nullptr) {
+			memset(data, 0, sizeof(Header));
+		}
+		if (!rebuild(INITIAL_CAPACITY, INITIAL_STRING_CAPACITY)) {
+			unlock();
+			return false;
+		}
+	}
+	return true;
+}
+
+void JumpIndex::unlock() {
+	flock(fd, LOCK_UN);
+}
+
+// Lays the file out again for capacity entries and stringCapacity bytes of paths (never smaller than it is),
+// dropping the garbage of removed entries. The caller holds LOCK_EX.
+bool JumpIndex::rebuild(uint32_t capacity, uint32_t stringCapacity) {
+	vector<uint64_t> oldMasks;
+	vector<Entry> oldEntries;
+	string oldStrings;
+	double totalRank = 0;
+	bool valid = data != nullptr && memcmp(header()->magic, JUMP_MAGIC, sizeof(JUMP_MAGIC)) == 0;
+	if (valid) {
+		uint32_t count = header()->count;
+		oldMasks.assign(masks(), masks() + count);
+		oldEntries.assign(entries(), entries() + count);
+		for (auto& entry : oldEntries) {
+			string path(strings() + entry.offset, entry.length);
+			entry.offset = uint32_t(oldStrings.size());
+			oldStrings += path;
+		}
+		totalRank = header()->totalRank;
+	}
+
+	size_t size = max(fileSize(capacity, stringCapacity), mapped);
+	if (ftruncate(fd, off_t(size)) < 0 || !mapFile()) {
+		return false;
+	}
+	// what is left over in a file that was laid out differently goes to the string area
+	stringCapacity = uint32_t(size - fileSize(capacity, 0));
+	Header* h = header();
+	memcpy(h->magic, JUMP_MAGIC, sizeof(JUMP_MAGIC));
+	h->count = uint32_t(oldEntries.size());
+	h->capacity = capacity;
+	h->stringBytes = uint32_t(oldStrings.size());
+	h->stringCapacity = stringCapacity;
+	h->garbageBytes = 0;
+	h->totalRank = totalRank;
+	copy(oldMasks.begin(), oldMasks.end(), masks());
+	copy(oldEntries.begin(), oldEntries.end(), entries());
+	memcpy(strings(), oldStrings.data(), oldStrings.size());
+	rebuildSlots();
+	return true;
+}
+
+void JumpIndex::rebuildSlots() {
+	uint32_t slotCount = 2 * header()->capacity;
+	uint32_t* table = slots();
+	memset(table, 0, slotCount * sizeof(uint32_t));
+	for (uint32_t i = 0; i < header()->count; i++) {
+		uint32_t slot = entries()[i].hash & (slotCount - 1);
+		while (table[slot] != 0) {
+			slot = (slot + 1) & (slotCount - 1);
+		}
+		table[slot] = i + 1;
+	}
+}
+
+// the slot of path, or the empty slot where it would go
+uint32_t* JumpIndex::findSlot(const string& path, uint32_t hash) {
+	uint32_t slotCount = 2 * header()->capacity;
+	uint32_t* table = slots();
+	for (uint32_t slot = hash & (slotCount - 1);; slot = (slot + 1) & (slotCount - 1)) {
+		if (table[slot] == 0) {
+			return &table[slot];
+		}
+		const Entry& entry = entries()[table[slot] - 1];
+		if (entry.hash == hash && entry.length == path.size() && memcmp(strings() + entry.offset, path.data(), path.size()) == 0) {
+			return &table[slot];
+		}
+	}
+}
+
+// Removes an entry by moving the last one in its place. This leaves the hash table stale, see rebuildSlots().
+void JumpIndex::removeEntry(uint32_t index) {
+	Header* h = header();
+	h->garbageBytes += entries()[index].length;
+	h->totalRank -= entries()[index].rank;
+	h->count--;
+	masks()[index] = masks()[h->count];
+	entries()[index] = entries()[h->count];
+}
+
+void JumpIndex::age() {
+	Header* h = header();
+	h->totalRank = 0;
+	for (uint32_t i = h->count; i-- > 0;) {
+		entries()[i].rank *= AGING_FACTOR;
+		if (entries()[i].rank < MIN_RANK) {
+			removeEntry(i);
+		}
+		else {
+			h->totalRank += entries()[i].rank;
+		}
+	}
+	h->totalRank = max(h->totalRank, 0.0);
+	rebuildSlots();
+}
+
+bool JumpIndex::record(const string& path, time_t now) {
+	if (path.empty() || path[0] != '/' || !lock(LOCK_EX)) {
+		return false;
+	}
+	uint32_t hash = hashPath(path.data(), path.size());
+	uint32_t* slot = findSlot(path, hash);
+	if (*slot == 0) {
+		Header* h = header();
+		uint32_t capacity = h->capacity;
+		uint32_t stringCapacity = h->stringCapacity;
+		size_t neededStrings = h->stringBytes - h->garbageBytes + path.size();
+		if (h->count == capacity) {
+			capacity *= 2;
+		}
+		while (neededStrings > stringCapacity) {
+			stringCapacity *= 2;
+		}
+		// full, or the paths don't fit unless the garbage goes
+		if (capacity != h->capacity || h->stringBytes + path.size() > stringCapacity) {
+			if (!rebuild(capacity, stringCapacity)) {
+				unlock();
+				return false;
+			}
+			slot = findSlot(path, hash);
+		}
+
+		h = header();
+		Entry entry = {};
+		entry.hash = hash;
+		entry.offset = h->stringBytes;
+		entry.length = uint32_t(path.size());
+		memcpy(strings() + h->stringBytes, path.data(), path.size());
+		h->stringBytes += entry.length;
+		masks()[h->count] = characterMask(path.data(), path.size());
+		entries()[h->count] = entry;
+		*slot = ++h->count;
+	}
+	Entry& entry = entries()[*slot - 1];
+	entry.rank += 1;
+	entry.lastVisit = uint32_t(now);
+	header()->totalRank += 1;
+	if (header()->totalRank > AGING_RANK) {
+		age();
+	}
+	unlock();
+	return true;
+}
+
+// The best matches for fragment (at most max of them, best first), skipping exclude. The caller holds the lock.
+vector<JumpIndex::Candidate> JumpIndex::candidates(const string& fragment, const string& exclude, time_t now, size_t max) {
+	string lower = fragment;
+	for (auto& c : lower) {
+		c = lowerCase(c);
+	}
+	uint64_t mask = characterMask(lower.data(), lower.size());
+	const uint64_t* entryMasks = masks();
+	const Entry* entryList = entries();
+	const char* text = strings();
+
+	vector<Candidate> best;
+	if (max == 0) {
+		return best;
+	}
+	for (uint32_t i = 0; i < header()->count; i++) {
+		if ((entryMasks[i] & mask) != mask) {
+			continue;
+		}
+		const Entry& entry = entryList[i];
+		Candidate candidate;
+		candidate.index = i;
+		candidate.quality = 2;
+		candidate.score = frecency(entry.rank, entry.lastVisit, now);
+		candidate.length = entry.length;
+		// not even the best quality would get it in, so don't bother looking at the path
+		if (best.size() == max && !(candidate < best.back())) {
+			continue;
+		}
+		const char* path = text + entry.offset;
+		const char* last = static_cast<const char*>(memrchr(path, '/', entry.length));
+		size_t lastStart = last != nullptr ? size_t(last - path) + 1 : 0;
+		if (!contains(path + lastStart, entry.length - lastStart, lower)) {
+			candidate.quality = 1;
+			if (!contains(path, entry.length, lower)) {
+				candidate.quality = 0;
+				if (!matchesScattered(path, entry.length, lower)) {
+					continue;
+				}
+			}
+		}
+		if (entry.length == exclude.size() && memcmp(path, exclude.data(), exclude.size()) == 0) {
+			continue;
+		}
+		// keep the best max, in order
+		if (best.size() == max && !(candidate < best.back())) {
+			continue;
+		}
+		best.insert(upper_bound(best.begin(), best.end(), candidate), candidate);
+		if (best.size() > max) {
+			best.pop_back();
+		}
+	}
+	return best;
+}
+
+string JumpIndex::find(const string& fragment, const string& exclude) {
+	if (fragment.empty() || !lock(LOCK_EX)) {
+		return "";
+	}
+	time_t now = time(nullptr);
+	string found;
+	vector<uint32_t> gone;
+	while (found.empty()) {
+		vector<Candidate> best = candidates(fragment, exclude, now, FIND_CANDIDATES);
+		for (const auto& candidate : best) {
+			const Entry& entry = entries()[candidate.index];
+			string path(strings() + entry.offset, entry.length);
+			struct stat st;
+			if (stat(path.c_str(), &st) == 0 && S_ISDIR(st.st_mode)) {
+				found = path;
+				break;
+			}
+			gone.push_back(candidate.index);
+		}
+		if (gone.empty() || best.size() < FIND_CANDIDATES) {
+			break;
+		}
+		if (found.empty()) {
+			// all of them are gone: remove them and look at the next best
+			sort(gone.rbegin(), gone.rend());
+			for (auto index : gone) {
+				removeEntry(index);
+			}
+			gone.clear();
+			rebuildSlots();
+		}
+	}
+	if (!gone.empty()) {
+		sort(gone.rbegin(), gone.rend());
+		for (auto index : gone) {
+			removeEntry(index);
+		}
+		rebuildSlots();
+	}
+	unlock();
+	return found;
+}
+
+vector<JumpMatch> JumpIndex::matches(const string& fragment, size_t max) {
+	vector<JumpMatch> retval;
+	if (!lock(LOCK_SH)) {
+		return retval;
+	}
+	for (const auto& candidate : candidates(fragment, "", time(nullptr), max)) {
+		const Entry& entry = entries()[candidate.index];
+		retval.push_back({ string(strings() + entry.offset, entry.length), candidate.score });
+	}
+	unlock();
+	return retval;
+}
+
+size_t JumpIndex::size() {
+	if (!lock(LOCK_SH)) {
+		return 0;
+	}
+	size_t count = header()->count;
+	unlock();
+	return count;
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+// Frecency-ranked index of the directories 'cd' went to, so 'cd proj' can jump to the best match,
+// like /home/me/code/project. It lives in one memory-mapped file that concurrent shells share,
+// each change made under an exclusive flock(2) of that file.
+//
+// A fragment matches a directory when its characters appear in the path in the same order,
+// ignoring case ('prj' matches .../project). Matches within the last path component beat matches
+// elsewhere in the path, which beat scattered characters. After that the most frecent directory
+// wins: the one visited most, weighted by how recently (like z and zoxide do).
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <time.h>
+
+struct JumpMatch
+{
+	std::string path;
+	double score; // frecency: visits weighted by how recent the last one was
+};
+
+class JumpIndex
+{
+public:
+	// the index in file, created when it doesn't exist yet
+	explicit JumpIndex(const std::string& file);
+	~JumpIndex();
+	JumpIndex(const JumpIndex&) = delete;
+	JumpIndex& operator=(const JumpIndex&) = delete;
+
+	// Counts a visit to path (an absolute directory) at time now.
+	// Returns false when the index is unavailable.
+	bool record(const std::string& path, time_t now = time(nullptr));
+	// The best match for fragment other than exclude (the current directory), "" when there is none.
+	// Directories that no longer exist are removed from the index when they come up.
+	std::string find(const std::string& fragment, const std::string& exclude = "");
+	// the best matches for fragment, at most max of them, best first
+	std::vector<JumpMatch> matches(const std::string& fragment, size_t max);
+	// number of directories in the index
+	size_t size();
+
+private:
+	struct Header;
+	struct Entry;
+	struct Candidate;
+
+	static size_t fileSize(uint32_t capacity, uint32_t stringCapacity);
+	bool lock(int operation);
+	void unlock();
+	bool mapFile();
+	bool rebuild(uint32_t capacity, uint32_t stringCapacity);
+	void removeEntry(uint32_t index);
+	void rebuildSlots();
+	uint32_t* findSlot(const std::string& path, uint32_t hash);
+	void age();
+	std::vector<Candidate> candidates(const std::string& fragment, const std::string& exclude, time_t now, size_t max);
+
+	Header* header();
+	uint64_t* masks();
+	Entry* entries();
+	uint32_t* slots();
+	char* strings();
+
+	int fd = -1;
+	char* data = nullptr;
+	size_t mapped = 0;
+};
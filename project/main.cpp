@@ -1,6 +1,15 @@
+#include <string.h>
+
 extern int shell(bool prompt);
+extern int shellCommand(const char* commandLine);
 
+// shell          interactive, with a prompt
+// shell -t       reads command lines from stdin without a prompt
+// shell -c CMD   runs the command line CMD and exits with its status
 int main(int argc, char** argv) {
+	if (argc == 3 && strcmp(argv[1], "-c") == 0) {
+		return shellCommand(argv[2]);
+	}
 	bool showPrompt = argc == 1;
 	return shell(showPrompt);
 }
@@ -0,0 +1,140 @@
+#include "bench.h"
+
+#include <chrono>
+#include <fcntl.h>
+#include <string>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "shell.h"
+
+using namespace std;
+
+namespace {
+
+volatile size_t sink;
+
+// baseline: a Shell::run of an assignment without anything to expand
+BENCHMARK(runPlainAssignment) {
+	Shell shell;
+	for (long i = 0; i < iterations; ++i)
+		sink = shell.run("a=plain").out.size();
+}
+
+// builtin fast path, no fork
+BENCHMARK(substitutionBuiltinPwd) {
+	Shell shell;
+	for (long i = 0; i < iterations; ++i)
+		sink = shell.run("a=$(pwd)").out.size();
+}
+
+BENCHMARK(substitutionBuiltinEcho) {
+	Shell shell;
+	for (long i = 0; i < iterations; ++i)
+		sink = shell.run("a=$(echo $HOME)").out.size();
+}
+
+// fork + exec + reading the output back through a pipe
+BENCHMARK(substitutionExternal) {
+	Shell shell;
+	for (long i = 0; i < iterations; ++i)
+		sink = shell.run("a=$(/bin/echo hi)").out.size();
+}
+
+// a whole pipeline with its output, errors and rusage collected
+BENCHMARK(runExternalPipeline) {
+	Shell shell;
+	for (long i = 0; i < iterations; ++i)
+		sink = shell.run("/bin/echo hi | /bin/cat").stages.size();
+}
+
+// the same pipeline submitted 100 at a time, all in flight together (see Shell::submit())
+BENCHMARK(submitExternalPipeline) {
+	Shell shell;
+	Expression expression = parseCommandLine("/bin/echo hi | /bin/cat");
+	for (long i = 0; i < iterations; ++i) {
+		shell.submit(expression, [](ShellResult& result) {
+			sink = result.out.size();
+		});
+		if (shell.pending() >= 100) {
+			shell.poll();
+		}
+	}
+	while (shell.poll() > 0) {
+	}
+}
+
+// a loop of a million iterations, evaluated entirely inside the shell
+BENCHMARK(countingLoopMillion) {
+	Shell shell;
+	for (long i = 0; i < iterations; ++i)
+		sink = shell.run("i=0; while [ $i -lt 1000000 ]; do i=$((i+1)); done").status;
+}
+
+// the shell binary, which is built next to this one
+string shellBinary() {
+	char buffer[4096];
+	ssize_t length = readlink("/proc/self/exe", buffer, sizeof(buffer));
+	string self(buffer, length > 0 ? size_t(length) : 0);
+	return self.substr(0, self.rfind('/') + 1) + "shell";
+}
+
+// Runs the program in argv (feeding it input on stdin) iterations times, and reports the average time
+// from fork() until the first byte of its output arrives, plus the highest peak RSS it reached (the
+// kernel reports the larger of the process and the children it waited for). That byte comes from the
+// first process it spawns, so for the shell it is exec-to-first-child latency.
+void measureStartup(long iterations, const vector<string>& args, const string& input) {
+	vector<char*> argv;
+	for (const auto& arg : args)
+		argv.push_back(const_cast<char*>(arg.c_str()));
+	argv.push_back(nullptr);
+	double firstOutputUs = 0;
+	long peakRssKiB = 0;
+	for (long i = 0; i < iterations; ++i) {
+		int out[2], in[2];
+		if (pipe2(out, O_CLOEXEC) < 0 || pipe2(in, O_CLOEXEC) < 0)
+			return;
+		auto start = chrono::steady_clock::now();
+		pid_t pid = fork();
+		if (pid == 0) {
+			dup2(in[0], STDIN_FILENO);
+			dup2(out[1], STDOUT_FILENO);
+			int null = open("/dev/null", O_WRONLY);
+			dup2(null, STDERR_FILENO);
+			execv(argv[0], argv.data());
+			_exit(127);
+		}
+		close(in[0]);
+		close(out[1]);
+		sink = size_t(write(in[1], input.data(), input.size()));
+		close(in[1]);
+		char byte;
+		sink = size_t(read(out[0], &byte, 1));
+		firstOutputUs += chrono::duration<double, micro>(chrono::steady_clock::now() - start).count();
+		close(out[0]);
+		int status;
+		struct rusage usage;
+		wait4(pid, &status, 0, &usage);
+		peakRssKiB = max(peakRssKiB, usage.ru_maxrss);
+	}
+	reportMetric("first output (us)", firstOutputUs / double(iterations));
+	reportMetric("peak RSS (KiB)", double(peakRssKiB));
+}
+
+// the floor: exec'ing the command directly
+BENCHMARK(startupDirectExec) {
+	measureStartup(iterations, { "/bin/echo", "x" }, "");
+}
+
+// shell -c, the lean startup path
+BENCHMARK(startupShellCommand) {
+	measureStartup(iterations, { shellBinary(), "-c", "/bin/echo x" }, "");
+}
+
+// the command line read from stdin, like the tests do
+BENCHMARK(startupShellStdin) {
+	measureStartup(iterations, { shellBinary(), "-t" }, "/bin/echo x\n");
+}
+
+}
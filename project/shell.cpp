@@ -19,8 +19,20 @@
 #include <sys/types.h>
 #include <sys/stat.h> // for open()
 #include <fcntl.h>
+#include <poll.h>
+#include <sys/timerfd.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/epoll.h>
 
 #include <vector>
+#include <algorithm>
+#include <unordered_map>
+#include <sstream>
+
+#include "shell.h"
+#include "jumpindex.h"
 
 // thanks to https://stackoverflow.com/a/14256296/6934388
 #define DEBUGMODE 0
@@ -33,29 +45,133 @@
 
 using namespace std;
 
-// Command structure holds command and arguments
-// e.g. with input  'tail -c 10', parts will be {"tail", "-c" , "10"}
-struct Command
+// int checked when changing directories.
+const int CHANGED_DIR_FLAG = 65;
+// int checked when another internal command (like 'deadline') was handled.
+const int BUILTIN_FLAG = 66;
+
+// exit status of a stage or expression that ran past its deadline (same as coreutils' timeout)
+const int TIMEOUT_EXIT_STATUS = 124;
+// time a timed out stage gets between SIGTERM and SIGKILL
+const long KILL_GRACE_MS = 1000;
+
+// counters printed by the 'metrics' command
+struct Metrics
 {
-	vector<string> parts = {};
+	unsigned long pipelines = 0;
+	unsigned long stages = 0;
+	unsigned long stageTimeouts = 0;
+	unsigned long deadlinesExpired = 0;
+	unsigned long kills = 0;
 };
 
-// Experssion structure holds:
-// - names of input/output files
-// - whether the expression should be executed in the background
-// - vector of all commands 
-//   e.g if input is 'ls -l | head', commands will be {Command, Command};
-//   (expands to) {{"ls", "-l"}, {"head"}}
-struct Expression
+// size of the ring buffer holding the output of one background job
+const size_t JOB_LOG_SIZE = 64 * 1024;
+// finished jobs whose log is kept around, the oldest one is dropped after that
+const size_t MAX_FINISHED_JOB_LOGS = 16;
+
+// One forked pipeline stage, as tracked by waitForStages()
+struct StageWait
 {
-	vector<Command> commands;
-	string inputFromFile;
-	string outputToFile;
-	bool background = false;
+	pid_t pid;
+	// the process group the stage is signalled through, so whatever it started goes too (0: just pid)
+	pid_t group = 0;
+	long timeoutMs = 0;
+	bool stopsUpstream = false; // when this stage exits, the stages before it get SIGPIPE
+	int pidfd = -1;
+	int timerfd = -1; // this stage's 'timeout' timer, -1 when not armed
+	bool termSent = false;
+	bool timedOut = false;
+	bool done = false;
+	int status = 0;
+	struct rusage usage = {}; // filled in when the stage is reaped
 };
 
-// int checked when changing directories.
-const int CHANGED_DIR_FLAG = 65;
+// Ring buffer over a memory-mapped memfd, keeping the last `size` bytes spliced into it.
+// The output of a background job lives here, so memory use stays bounded however chatty the job is.
+struct JobLog
+{
+	int memfd = -1;
+	char* data = nullptr; // read-only mapping of memfd
+	size_t size = 0;
+	uint64_t written = 0; // total bytes ever written, the ring position is written % size
+};
+
+// A background expression, kept until it has been reaped (and its log is no longer wanted)
+struct Job
+{
+	int id;
+	string description;
+	vector<StageWait> stages;
+	size_t running = 0;
+	int logfd = -1; // read end of the job's output pipe, while it is being captured
+	JobLog log;
+};
+
+// A pipeline of Shell::submit(), watched by the epoll loop of its session (see Shell::poll())
+struct AsyncPipeline
+{
+	Expression expression;
+	vector<StageWait> stages;
+	pid_t pgid = 0;
+	size_t running = 0;
+	int capturefd = -1; // read ends of the output and error pipes, until EOF
+	int errorfd = -1;
+	int deadlinefd = -1;
+	bool deadlineExpired = false;
+	ShellResult result;
+	ShellCompletion done;
+};
+
+// Everything a shell session keeps between command lines. The interactive shell has one (see shell()),
+// and so does every Shell of the library interface (see shell.h), so one process can hold many sessions.
+struct Session
+{
+	// default deadline for every foreground expression in ms (0 = none), see 'deadline'
+	long defaultDeadlineMs = 0;
+	// exit status of the last foreground expression
+	int lastExitStatus = 0;
+	// shell variables, set with 'NAME=value'. Variables that aren't set here are looked up in the environment.
+	unordered_map<string, string> variables;
+	Metrics metrics;
+	// whether expressions are rewritten by optimizeExpression before they run (see 'optimize')
+	bool optimizing = true;
+	// whether background expressions get their output captured in a job log (see 'joblog')
+	bool jobLogging = false;
+	vector<Job> jobs;
+	int nextJobId = 1;
+
+	// where the messages of the shell itself go
+	ostream* out = &cout;
+	ostream* err = &cerr;
+	// A session of the library interface runs inside another program, so it doesn't touch the process:
+	// 'cd' changes cwd instead of the current directory, 'exit' sets exitRequested instead of exiting,
+	// stages don't get the terminal, and their output and errors end up in out and err.
+	bool embedded = false;
+	// A command substitution runs in a copy of the session (see captureOutput), where 'cd' and 'exit'
+	// don't touch the process either. cwd is empty there until 'cd' sets it, like in the interactive shell.
+	bool subshell = false;
+	string cwd;
+	bool exitRequested = false;
+	// when set, every foreground stage that ran as a process is added here
+	vector<StageResult>* stageResults = nullptr;
+
+	// Shell::submit(): the completion of the expression being submitted, until executeCommands takes it
+	ShellCompletion* submitted = nullptr;
+	// the submitted pipelines in flight, by id, and the epoll instance over their pidfds, timers and pipes
+	unordered_map<unsigned long, AsyncPipeline> pipelines;
+	unsigned long nextPipelineId = 1;
+	int epollfd = -1;
+	// submitted expressions that finished without starting processes, completed by the next Shell::poll()
+	vector<pair<ShellCompletion, ShellResult>> finished;
+
+	// the directories 'cd' went to, opened by jumpIndex() the first time it's needed
+	unique_ptr<JumpIndex> jumps;
+	bool jumpsOpened = false;
+};
+
+// the session running a command line on this thread
+thread_local Session* session = nullptr;
 
 // Parses a string to form a vector of arguments. The seperator is a space char (' ').
 vector<string> splitString(const string& str, char delimiter = ' ') {
@@ -77,6 +193,55 @@ vector<string> splitString(const string& str, char delimiter = ' ') {
 	return retval;
 }
 
+// Returns the length of the command substitution ('$(...)' or '`...`') starting at str[pos],
+// or 0 when there is none. Parentheses nest, so '$(echo $(pwd))' is a single substitution.
+size_t substitutionLength(const string& str, size_t pos) {
+	if (str[pos] == '`') {
+		size_t close = str.find('`', pos + 1);
+		return close == string::npos ? 0 : close - pos + 1;
+	}
+	if (str[pos] != '$' || pos + 1 >= str.length() || str[pos + 1] != '(') {
+		return 0;
+	}
+	int depth = 0;
+	for (size_t i = pos + 1; i < str.length(); ++i) {
+		if (str[i] == '(') {
+			depth++;
+		}
+		else if (str[i] == ')' && --depth == 0) {
+			return i - pos + 1;
+		}
+	}
+	return 0;
+}
+
+// Parses a duration like '5', '1.5s', '200ms', '2m' or '1h' into milliseconds.
+// A bare number means seconds. Returns false (leaving ms untouched) if str is not a duration.
+bool parseDuration(const string& str, long& ms) {
+	char* end = nullptr;
+	errno = 0;
+	double value = strtod(str.c_str(), &end);
+	if (end == str.c_str() || errno != 0 || !(value >= 0) || value > 1e9)
+		return false;
+	string unit(end);
+	double scale;
+	if (unit.empty() || unit == "s")
+		scale = 1000;
+	else if (unit == "ms")
+		scale = 1;
+	else if (unit == "m")
+		scale = 60 * 1000;
+	else if (unit == "h")
+		scale = 60 * 60 * 1000;
+	else
+		return false;
+	ms = long(value * scale);
+	// don't let something like 0.1ms round down to 'no deadline'
+	if (ms == 0 && value > 0)
+		ms = 1;
+	return true;
+}
+
 // wrapper around the C execvp so it can be called with C++ strings (easier to work with)
 // always start with the command itself
 // always terminate with a NULL pointer
@@ -131,333 +296,2670 @@ void displayCustomPrompt(char* dir) {
 		else {
 			cout << "\e[";
 		}
-		if (i == 0 || i == 1 || i == dir_amt - 3 || i == dir_amt - 2) {
-			cout << "\e[" << SEPCOLOR << "m" << "->";
+		if (i == 0 || i == 1 || i == dir_amt - 3 || i == dir_amt - 2) {
+			cout << "\e[" << SEPCOLOR << "m" << "->";
+		}
+	}
+	cout << "\e[" << SEPCOLOR << "m Ω " << "\e[" << OMEGACOLOR << "m";
+}
+
+void displayStandardPrompt(char* dir) {
+	if (dir) {
+		cout << "\e[32m" << dir << "\e[39m";
+	}
+	cout << "$ ";
+}
+
+// shows a user prompt in the terminal showing the current working dir and a $
+void displayPrompt() {
+	char buffer[512];
+	char* dir = getcwd(buffer, sizeof(buffer));
+
+#if SHELLTHEME == 1
+	displayCustomPrompt(dir);
+#else 
+	displayStandardPrompt(dir);
+#endif
+
+	flush(cout);
+}
+
+void waitForInput();
+
+// gets the current input from the commandline
+// (and shows prompt if showPrompt==True)
+string requestCommandLine(bool showPrompt) {
+	if (showPrompt) {
+		displayPrompt();
+	}
+	waitForInput();
+	string retval;
+	getline(cin, retval);
+	return retval;
+}
+
+// A token of a command line: a word (which may contain substitutions) or an operator
+struct Token
+{
+	string text;
+	bool isOperator;
+};
+
+// Splits a command line into words and the operators ';' '&' '&&' '|' '||' '<' '>' and newline.
+// Spaces separate words, except inside a command substitution.
+vector<Token> tokenize(const string& line) {
+	vector<Token> tokens;
+	string word;
+	auto endWord = [&]() {
+		if (!word.empty()) {
+			tokens.push_back({ word, false });
+			word.clear();
+		}
+	};
+	for (size_t pos = 0; pos < line.length();) {
+		char c = line[pos];
+		size_t length = substitutionLength(line, pos);
+		if (length > 0) {
+			word += line.substr(pos, length);
+			pos += length;
+		}
+		else if (c == ' ' || c == '\t') {
+			endWord();
+			pos++;
+		}
+		else if (c == '\n' || c == ';' || c == '<' || c == '>') {
+			endWord();
+			tokens.push_back({ string(1, c), true });
+			pos++;
+		}
+		else if (c == '&' || c == '|') {
+			endWord();
+			size_t size = pos + 1 < line.length() && line[pos + 1] == c ? 2 : 1;
+			tokens.push_back({ string(size, c), true });
+			pos += size;
+		}
+		else {
+			word += c;
+			pos++;
+		}
+	}
+	endWord();
+	return tokens;
+}
+
+// A parsed command line. Words stay unexpanded, so a loop body is parsed once and expanded anew on every iteration.
+// - PIPELINE: runs expression
+// - ASSIGNMENT: words are the 'NAME=value' assignments
+// - SEQUENCE: runs children in order ('a; b')
+// - AND, OR: children[1] runs only if children[0] succeeded ('a && b') or failed ('a || b')
+// - IF: children are condition/body pairs, followed by the else body when their number is odd
+// - WHILE, UNTIL: children are the condition and the body
+// - FOR: children[0] runs for every expanded word in words, with that word in variable
+struct Node
+{
+	enum Kind { PIPELINE, ASSIGNMENT, SEQUENCE, AND, OR, IF, WHILE, UNTIL, FOR };
+	Kind kind = SEQUENCE;
+	Expression expression;
+	vector<string> words;
+	string variable;
+	vector<Node> children;
+};
+
+// State of the recursive descent parser over the tokens of a command line
+struct Parser
+{
+	vector<Token> tokens;
+	size_t pos = 0;
+	string error; // the first syntax error
+	bool incomplete = false; // the input ended inside a construct, more lines may complete it
+};
+
+const Token* peek(const Parser& parser) {
+	return parser.pos < parser.tokens.size() ? &parser.tokens[parser.pos] : nullptr;
+}
+
+bool isOperator(const Token* token, const char* op) {
+	return token != nullptr && token->isOperator && token->text == op;
+}
+
+bool isKeyword(const Token* token, const char* keyword) {
+	return token != nullptr && !token->isOperator && token->text == keyword;
+}
+
+void syntaxError(Parser& parser) {
+	if (!parser.error.empty()) {
+		return;
+	}
+	const Token* token = peek(parser);
+	if (token == nullptr) {
+		parser.incomplete = true;
+		parser.error = "syntax error: unexpected end of input";
+	}
+	else {
+		parser.error = "syntax error near unexpected token '" + (token->text == "\n" ? string("newline") : token->text) + "'";
+	}
+}
+
+bool expectKeyword(Parser& parser, const char* keyword) {
+	if (!isKeyword(peek(parser), keyword)) {
+		syntaxError(parser);
+		return false;
+	}
+	parser.pos++;
+	return true;
+}
+
+void skipNewlines(Parser& parser) {
+	while (isOperator(peek(parser), "\n")) {
+		parser.pos++;
+	}
+}
+
+bool isName(const string& str) {
+	if (str.empty() || !(isalpha(str[0]) || str[0] == '_')) {
+		return false;
+	}
+	for (char c : str) {
+		if (!(isalnum(c) || c == '_')) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// true for 'NAME=value'
+bool isAssignment(const string& word) {
+	size_t equals = word.find('=');
+	return equals != string::npos && isName(word.substr(0, equals));
+}
+
+// Builds a command from its words.
+// 'timeout DURATION cmd ...' puts a deadline on this stage only (nested ones keep the shortest).
+// Anything that isn't a duration (like 'timeout -s KILL') is left for the external timeout command.
+Command makeCommand(const vector<string>& args) {
+	Command command = { args };
+	long ms;
+	while (command.parts.size() > 2 && command.parts[0] == "timeout" && parseDuration(command.parts[1], ms)) {
+		if (ms > 0 && (command.timeoutMs == 0 || ms < command.timeoutMs))
+			command.timeoutMs = ms;
+		command.parts.erase(command.parts.begin(), command.parts.begin() + 2);
+	}
+	return command;
+}
+
+Node parseList(Parser& parser, const vector<string>& terminators);
+
+// compound := if list then list [elif list then list]... [else list] fi
+//           | while|until list do list done
+//           | for NAME in word... (; | newline) do list done
+Node parseCompound(Parser& parser) {
+	Node node;
+	string keyword = peek(parser)->text;
+	parser.pos++;
+	if (keyword == "if") {
+		node.kind = Node::IF;
+		while (true) {
+			node.children.push_back(parseList(parser, { "then" }));
+			if (!expectKeyword(parser, "then")) {
+				return node;
+			}
+			node.children.push_back(parseList(parser, { "elif", "else", "fi" }));
+			if (!parser.error.empty() || !isKeyword(peek(parser), "elif")) {
+				break;
+			}
+			parser.pos++;
+		}
+		if (parser.error.empty() && isKeyword(peek(parser), "else")) {
+			parser.pos++;
+			node.children.push_back(parseList(parser, { "fi" }));
+		}
+		expectKeyword(parser, "fi");
+	}
+	else if (keyword == "while" || keyword == "until") {
+		node.kind = keyword == "while" ? Node::WHILE : Node::UNTIL;
+		node.children.push_back(parseList(parser, { "do" }));
+		if (expectKeyword(parser, "do")) {
+			node.children.push_back(parseList(parser, { "done" }));
+			expectKeyword(parser, "done");
+		}
+	}
+	else {
+		node.kind = Node::FOR;
+		const Token* name = peek(parser);
+		if (name == nullptr || name->isOperator || !isName(name->text)) {
+			syntaxError(parser);
+			return node;
+		}
+		node.variable = name->text;
+		parser.pos++;
+		skipNewlines(parser);
+		if (!expectKeyword(parser, "in")) {
+			return node;
+		}
+		while (peek(parser) != nullptr && !peek(parser)->isOperator) {
+			node.words.push_back(peek(parser)->text);
+			parser.pos++;
+		}
+		if (!isOperator(peek(parser), ";") && !isOperator(peek(parser), "\n")) {
+			syntaxError(parser);
+			return node;
+		}
+		parser.pos++;
+		skipNewlines(parser);
+		if (expectKeyword(parser, "do")) {
+			node.children.push_back(parseList(parser, { "done" }));
+			expectKeyword(parser, "done");
+		}
+	}
+	return node;
+}
+
+// pipeline := compound | command [< file] ['|' command]... [> file]
+// where a command is a list of words, or only 'NAME=value' words for an assignment
+Node parsePipeline(Parser& parser) {
+	Node node;
+	const Token* token = peek(parser);
+	if (isKeyword(token, "if") || isKeyword(token, "while") || isKeyword(token, "until") || isKeyword(token, "for")) {
+		node = parseCompound(parser);
+		if (parser.error.empty() && (isOperator(peek(parser), "|") || isOperator(peek(parser), "<") || isOperator(peek(parser), ">"))) {
+			parser.error = "compound commands can't be piped or redirected";
+		}
+		return node;
+	}
+
+	node.kind = Node::PIPELINE;
+	Expression& expression = node.expression;
+	while (true) {
+		vector<string> args;
+		for (token = peek(parser); token != nullptr; token = peek(parser)) {
+			if (!token->isOperator) {
+				args.push_back(token->text);
+				parser.pos++;
+				continue;
+			}
+			if (token->text != "<" && token->text != ">") {
+				break;
+			}
+			// the input can only be redirected for the first command, the output only for the last
+			bool input = token->text == "<";
+			if ((input && !expression.commands.empty()) || !expression.outputToFile.empty()) {
+				syntaxError(parser);
+				return node;
+			}
+			parser.pos++;
+			if (peek(parser) == nullptr || peek(parser)->isOperator) {
+				syntaxError(parser);
+				return node;
+			}
+			(input ? expression.inputFromFile : expression.outputToFile) = peek(parser)->text;
+			parser.pos++;
+		}
+		if (args.empty()) {
+			syntaxError(parser);
+			return node;
+		}
+		expression.commands.push_back(makeCommand(args));
+		if (!isOperator(peek(parser), "|")) {
+			break;
+		}
+		if (!expression.outputToFile.empty()) {
+			syntaxError(parser);
+			return node;
+		}
+		parser.pos++;
+		skipNewlines(parser);
+	}
+
+	const vector<string>& parts = expression.commands[0].parts;
+	if (expression.commands.size() == 1 && expression.inputFromFile.empty() && expression.outputToFile.empty()
+		&& expression.commands[0].timeoutMs == 0 && all_of(parts.begin(), parts.end(), isAssignment)) {
+		node.kind = Node::ASSIGNMENT;
+		node.words = parts;
+		node.expression = Expression();
+	}
+	return node;
+}
+
+// andOr := pipeline [(&& | ||) pipeline]...
+Node parseAndOr(Parser& parser) {
+	Node node = parsePipeline(parser);
+	while (parser.error.empty() && (isOperator(peek(parser), "&&") || isOperator(peek(parser), "||"))) {
+		Node combined;
+		combined.kind = peek(parser)->text == "&&" ? Node::AND : Node::OR;
+		parser.pos++;
+		skipNewlines(parser);
+		combined.children.push_back(node);
+		combined.children.push_back(parsePipeline(parser));
+		node = combined;
+	}
+	return node;
+}
+
+// list := andOr [(; | & | newline) andOr]...
+// Stops at the end of the input, or at one of the terminators (like 'fi') where a command would start.
+Node parseList(Parser& parser, const vector<string>& terminators) {
+	Node list;
+	while (parser.error.empty()) {
+		skipNewlines(parser);
+		const Token* token = peek(parser);
+		if (token == nullptr || (!token->isOperator && find(terminators.begin(), terminators.end(), token->text) != terminators.end())) {
+			break;
+		}
+		Node node = parseAndOr(parser);
+		if (!parser.error.empty()) {
+			break;
+		}
+		token = peek(parser);
+		if (isOperator(token, "&")) {
+			if (node.kind != Node::PIPELINE) {
+				parser.error = "only pipelines can run in the background";
+				break;
+			}
+			node.expression.background = true;
+			parser.pos++;
+		}
+		else if (isOperator(token, ";") || isOperator(token, "\n")) {
+			parser.pos++;
+		}
+		else if (token != nullptr) {
+			syntaxError(parser);
+		}
+		list.children.push_back(node);
+	}
+	// conditions and bodies of compound commands can't be empty
+	if (parser.error.empty() && list.children.empty() && !terminators.empty()) {
+		syntaxError(parser);
+	}
+	return list;
+}
+
+// Parses a command line with pipelines, control flow ('if', 'while', 'until', 'for'),
+// sequences ('a; b', 'a && b', 'a || b') and assignments. See parser.error for syntax errors.
+// Command substitutions and variables stay unexpanded words here, they are expanded right before execution (see expandWord).
+Node parseScript(const string& script, Parser& parser) {
+	parser = Parser();
+	parser.tokens = tokenize(script);
+	Node node = parseList(parser, {});
+	if (parser.error.empty() && peek(parser) != nullptr) {
+		syntaxError(parser);
+	}
+	return node;
+}
+
+// note: For such a simple shell, there is little need for a full blown parser (as in an LL or LR capable parser).
+// This parses a command line holding a single pipeline, like 'cmd1 arg1 < inputfile | cmd2 arg2 > outputfile &',
+// with the parser above. Anything else (or an empty line) gives an empty expression.
+Expression parseCommandLine(const string& commandLine, string* error) {
+	Parser parser;
+	Node script = parseScript(commandLine, parser);
+	if (!parser.error.empty() || script.children.size() != 1 || script.children[0].kind != Node::PIPELINE) {
+		if (error != nullptr) {
+			*error = !parser.error.empty() ? parser.error : "not a single pipeline";
+		}
+		return Expression();
+	}
+	return script.children[0].expression;
+}
+
+// Turns an expression back into a command line, e.g. for listing jobs
+string describeExpression(const Expression& expression) {
+	string retval;
+	for (size_t i = 0; i < expression.commands.size(); ++i) {
+		if (i > 0) {
+			retval += " | ";
+		}
+		const Command& command = expression.commands[i];
+		if (command.timeoutMs > 0) {
+			retval += "timeout " + to_string(command.timeoutMs) + "ms ";
+		}
+		for (size_t j = 0; j < command.parts.size(); ++j) {
+			retval += (j > 0 ? " " : "") + command.parts[j];
+		}
+		if (i == 0 && !expression.inputFromFile.empty()) {
+			retval += " < " + expression.inputFromFile;
+		}
+	}
+	if (!expression.outputToFile.empty()) {
+		retval += " > " + expression.outputToFile;
+	}
+	if (expression.background) {
+		retval += " &";
+	}
+	return retval;
+}
+
+
+// path relative to the session's directory (see Session::cwd), for opening files from the shell itself
+string sessionPath(const string& path) {
+	if (session->cwd.empty() || path.empty() || path[0] == '/') {
+		return path;
+	}
+	return session->cwd + "/" + path;
+}
+
+// The jump index of the session: $SHELL_JUMP_DB, or else ~/.shell_jumps. nullptr when there is neither.
+JumpIndex* jumpIndex() {
+	if (!session->jumpsOpened) {
+		session->jumpsOpened = true;
+		const char* file = getenv("SHELL_JUMP_DB");
+		const char* home = getenv("HOME");
+		if (file != NULL && file[0] != '\0') {
+			session->jumps.reset(new JumpIndex(file));
+		}
+		else if (home != NULL) {
+			session->jumps.reset(new JumpIndex(string(home) + "/.shell_jumps"));
+		}
+	}
+	return session->jumps.get();
+}
+
+// whether 'cd' and 'exit' change the session rather than the process (see Session::embedded)
+bool keepsProcess() {
+	return session->embedded || session->subshell;
+}
+
+// the current directory of the session, absolute
+string currentDirectory() {
+	if (!session->cwd.empty()) {
+		return session->cwd;
+	}
+	char buffer[MAXPATHLEN];
+	return getcwd(buffer, sizeof(buffer)) != NULL ? buffer : "";
+}
+
+// counts a visit to the current directory in the jump index
+void recordDirectory() {
+	if (JumpIndex* index = jumpIndex()) {
+		index->record(currentDirectory());
+	}
+}
+
+// 'cd fragment' where fragment is no directory: go to the best match for it in the jump index.
+// Returns false when nothing matches.
+bool jumpToDirectory(const string& fragment) {
+	JumpIndex* index = jumpIndex();
+	string found = index != nullptr ? index->find(fragment, currentDirectory()) : "";
+	if (found.empty()) {
+		return false;
+	}
+	if (keepsProcess()) {
+		session->cwd = found;
+	}
+	else if (chdir(found.c_str()) < 0) {
+		*session->err << "cd error:" << endl;
+		*session->err << found << ": " << strerror(errno) << endl;
+		return true;
+	}
+	*session->out << found << endl;
+	index->record(found);
+	return true;
+}
+
+// changes the directory of an embedded session or subshell (see Session::cwd) to path, without chdir'ing the process
+int changeSessionDirectory(const string& path) {
+	char buffer[MAXPATHLEN];
+	struct stat st;
+	if (realpath(sessionPath(path).c_str(), buffer) == NULL || stat(buffer, &st) < 0) {
+		int error = errno;
+		if (error != ENOENT || !jumpToDirectory(path)) {
+			*session->err << "cd error:" << endl;
+			*session->err << strerror(error) << endl;
+		}
+		return CHANGED_DIR_FLAG;
+	}
+	if (!S_ISDIR(st.st_mode)) {
+		*session->err << "cd error:" << endl;
+		*session->err << strerror(ENOTDIR) << endl;
+		return CHANGED_DIR_FLAG;
+	}
+	session->cwd = buffer;
+	recordDirectory();
+	return CHANGED_DIR_FLAG;
+}
+
+// Change current directory to the users $HOME directory
+int goHome() {
+	char* home_dir;
+
+	home_dir = getenv("HOME");
+	if (home_dir != NULL && keepsProcess()) {
+		return changeSessionDirectory(home_dir);
+	}
+	if (home_dir != NULL) {
+		if( chdir(home_dir) < 0){
+			*session->err << "Error when changing to home directory" <<endl;
+			*session->err << strerror(errno) << endl;
+		}
+		else {
+			recordDirectory();
+		}
+		return CHANGED_DIR_FLAG;
+	}
+	else {
+		*session->err << "no $HOME directory found" << endl;
+		return -1;
+	}
+}
+
+// Handle a 'cd' command, only handles a single viable path.
+// When the path doesn't exist, it is looked up in the jump index (see jumpToDirectory). Other errors
+// (like a path that is a file, or a directory without permission) are reported.
+int handleChangeDirectory(Command cmd) {
+	// only cd, we chdir to $HOME.
+	if (cmd.parts.size() == 1) {
+		return goHome();
+	}
+	// we won't handle multiple arguments. Just a single directory.
+	else if (cmd.parts.size() != 2) {
+		*session->err << "Wrong amount of arguments for cd " << endl;
+		*session->err << "Usage: cd <path>" << endl;
+		return CHANGED_DIR_FLAG;
+	}
+	// ~ indicates user $HOME directory, for this shell. So go home.
+	else if (cmd.parts.at(1).compare("~") == 0) {
+		return goHome();
+	}
+	else if (keepsProcess()) {
+		return changeSessionDirectory(cmd.parts.at(1));
+	}
+	// last case, try to go to the specified directory.
+	else if ((chdir(cmd.parts.at(1).c_str())) < 0) {
+		int error = errno;
+		if (error != ENOENT || !jumpToDirectory(cmd.parts.at(1))) {
+			*session->err << "cd error:" << endl;
+			*session->err << strerror(error) << endl;
+		}
+	}
+	else {
+		recordDirectory();
+	}
+	return CHANGED_DIR_FLAG;
+}
+
+// Handle a 'jumps' command: list the directories of the jump index that best match a fragment.
+int handleJumps(const Command& cmd) {
+	if (cmd.parts.size() > 2) {
+		*session->err << "Usage: jumps [FRAGMENT]" << endl;
+		return BUILTIN_FLAG;
+	}
+	JumpIndex* index = jumpIndex();
+	if (index == nullptr) {
+		*session->err << "no jump index: set $SHELL_JUMP_DB or $HOME" << endl;
+		return BUILTIN_FLAG;
+	}
+	for (const auto& match : index->matches(cmd.parts.size() == 2 ? cmd.parts[1] : "", 10)) {
+		*session->out << static_cast<long>(match.score) << "\t" << match.path << endl;
+	}
+	return BUILTIN_FLAG;
+}
+
+
+// Handle a 'deadline' command: show or set the default deadline of every foreground expression.
+// 'deadline 0' or 'deadline off' removes it again. Background jobs ('cmd &') run without one.
+int handleDeadline(const Command& cmd) {
+	if (cmd.parts.size() == 1) {
+		if (session->defaultDeadlineMs == 0) {
+			*session->out << "no deadline" << endl;
+		}
+		else {
+			*session->out << "deadline " << session->defaultDeadlineMs << "ms" << endl;
+		}
+		return BUILTIN_FLAG;
+	}
+	long ms = 0;
+	if (cmd.parts.size() != 2 || (cmd.parts[1] != "off" && !parseDuration(cmd.parts[1], ms))) {
+		*session->err << "Usage: deadline [DURATION|off]" << endl;
+		return BUILTIN_FLAG;
+	}
+	session->defaultDeadlineMs = ms;
+	return BUILTIN_FLAG;
+}
+
+// Handle a 'metrics' command: print the execution counters.
+int handleMetrics() {
+	*session->out << "pipelines: " << session->metrics.pipelines << endl;
+	*session->out << "stages: " << session->metrics.stages << endl;
+	*session->out << "stage timeouts: " << session->metrics.stageTimeouts << endl;
+	*session->out << "expired deadlines: " << session->metrics.deadlinesExpired << endl;
+	*session->out << "kills: " << session->metrics.kills << endl;
+	return BUILTIN_FLAG;
+}
+
+
+int handleJobLog(const Command& cmd);
+int handleExplain(Expression expression);
+
+// Handle an 'optimize' command: show, or turn on/off rewriting expressions before they run.
+int handleOptimize(const Command& cmd) {
+	if (cmd.parts.size() == 1) {
+		*session->out << "optimize " << (session->optimizing ? "on" : "off") << endl;
+	}
+	else if (cmd.parts.size() == 2 && (cmd.parts[1] == "on" || cmd.parts[1] == "off")) {
+		session->optimizing = cmd.parts[1] == "on";
+	}
+	else {
+		*session->err << "Usage: optimize [on|off]" << endl;
+	}
+	return BUILTIN_FLAG;
+}
+
+// Handle exit, change dir and the other internal commands.
+int handleInternalCommands(Expression& expression) {
+	// explain takes the whole expression after it, so look at it before anything else
+	if (!expression.commands[0].parts.empty() && expression.commands[0].parts[0].compare("explain") == 0) {
+		return handleExplain(expression);
+	}
+	for (const auto& command : expression.commands) {
+		if (command.parts.empty()) {
+			continue;
+		}
+		if (command.parts[0].compare("exit") == 0 && keepsProcess()) {
+			// ends the session (or subshell), not the program it runs in
+			session->exitRequested = true;
+			return BUILTIN_FLAG;
+		}
+		if (command.parts[0].compare("exit") == 0) {
+			*session->out << "Bye!" << endl;
+			flush(*session->out);
+			exit(0);
+		}
+		if (command.parts[0].compare("cd") == 0) {
+			return handleChangeDirectory(command);
+		}
+		if (command.parts[0].compare("jumps") == 0) {
+			return handleJumps(command);
+		}
+		if (command.parts[0].compare("deadline") == 0) {
+			return handleDeadline(command);
+		}
+		if (command.parts[0].compare("metrics") == 0) {
+			return handleMetrics();
+		}
+		if (command.parts[0].compare("joblog") == 0) {
+			return handleJobLog(command);
+		}
+		if (command.parts[0].compare("optimize") == 0) {
+			return handleOptimize(command);
+		}
+	}
+	return 0;
+}
+
+
+// Builtins that only produce output, so they can be evaluated inside the shell without forking.
+// They append their output to out and return an exit status, or BUILTIN_DECLINED (before writing
+// anything) when they don't handle their arguments the way the program of the same name does:
+// the program runs instead then.
+typedef int (*Builtin)(const vector<string>& args, string& out);
+const int BUILTIN_DECLINED = -1;
+
+int builtinEcho(const vector<string>& args, string& out) {
+	bool newline = args.size() < 2 || args[1] != "-n";
+	size_t first = newline ? 1 : 2;
+	// /bin/echo has more options (-e, -E, repeated or combined ones, --help), those are left to it
+	if (first < args.size() && args[first].size() > 1 && args[first][0] == '-') {
+		return BUILTIN_DECLINED;
+	}
+	for (size_t i = first; i < args.size(); ++i) {
+		if (i > first) {
+			out += ' ';
+		}
+		out += args[i];
+	}
+	if (newline) {
+		out += '\n';
+	}
+	return 0;
+}
+
+int builtinPwd(const vector<string>& args, string& out) {
+	char buffer[MAXPATHLEN];
+	if (!session->cwd.empty()) {
+		out += session->cwd;
+	}
+	else if (getcwd(buffer, sizeof(buffer)) == NULL) {
+		*session->err << "pwd: " << strerror(errno) << endl;
+		return 1;
+	}
+	else {
+		out += buffer;
+	}
+	out += '\n';
+	return 0;
+}
+
+int builtinTrue(const vector<string>& args, string& out) {
+	return 0;
+}
+
+int builtinFalse(const vector<string>& args, string& out) {
+	return 1;
+}
+
+// strtoll, with a fast path for plain decimal numbers of up to 18 digits (which can't overflow):
+// loops parse a few of those on every iteration, and strtoll takes a good part of that time.
+long long parseNumber(const char* text, char** end, int base) {
+	const char* pos = text;
+	bool negative = *pos == '-';
+	if (*pos == '-' || *pos == '+') {
+		pos++;
+	}
+	const char* digits = pos;
+	long long value = 0;
+	while (*pos >= '0' && *pos <= '9' && pos - digits < 19) {
+		value = value * 10 + (*pos - '0');
+		pos++;
+	}
+	size_t length = size_t(pos - digits);
+	// leading whitespace, 0x.. and 0.. (octal with base 0), or too many digits: leave it to strtoll
+	if (length == 0 || length > 18 || (*pos >= '0' && *pos <= '9') || (base == 0 && *digits == '0' && length > 1)
+		|| (base == 0 && *digits == '0' && (*pos == 'x' || *pos == 'X'))) {
+		return strtoll(text, end, base);
+	}
+	if (end != nullptr) {
+		*end = const_cast<char*>(pos);
+	}
+	return negative ? -value : value;
+}
+
+// parses all of str as an integer for 'test'
+bool parseInteger(const string& str, long long& value) {
+	char* end = nullptr;
+	errno = 0;
+	value = parseNumber(str.c_str(), &end, 10);
+	return !str.empty() && *end == '\0' && errno == 0;
+}
+
+// The unary FILE operator op of 'test' (like -d or -L), for path. Returns false when op isn't one.
+bool testFile(const string& op, const string& path, bool& result) {
+	if (op.size() != 2 || op[0] != '-' || strchr("bcdefgGhkLOprsSuwx", op[1]) == nullptr) {
+		return false;
+	}
+	char kind = op[1];
+	if (kind == 'r' || kind == 'w' || kind == 'x') {
+		result = access(path.c_str(), kind == 'r' ? R_OK : kind == 'w' ? W_OK : X_OK) == 0;
+		return true;
+	}
+	struct stat st;
+	bool link = kind == 'h' || kind == 'L';
+	if ((link ? lstat(path.c_str(), &st) : stat(path.c_str(), &st)) != 0) {
+		result = false;
+		return true;
+	}
+	switch (kind) {
+	case 'b': result = S_ISBLK(st.st_mode); break;
+	case 'c': result = S_ISCHR(st.st_mode); break;
+	case 'd': result = S_ISDIR(st.st_mode); break;
+	case 'f': result = S_ISREG(st.st_mode); break;
+	case 'g': result = (st.st_mode & S_ISGID) != 0; break;
+	case 'G': result = st.st_gid == getegid(); break;
+	case 'h':
+	case 'L': result = S_ISLNK(st.st_mode); break;
+	case 'k': result = (st.st_mode & S_ISVTX) != 0; break;
+	case 'O': result = st.st_uid == geteuid(); break;
+	case 'p': result = S_ISFIFO(st.st_mode); break;
+	case 's': result = st.st_size > 0; break;
+	case 'S': result = S_ISSOCK(st.st_mode); break;
+	case 'u': result = (st.st_mode & S_ISUID) != 0; break;
+	default: result = true; break; // -e
+	}
+	return true;
+}
+
+// FILE1 -nt|-ot|-ef FILE2 of 'test': a file that exists is newer than one that doesn't
+bool compareFiles(const string& left, const string& op, const string& right) {
+	struct stat a, b;
+	bool hasLeft = stat(left.c_str(), &a) == 0;
+	bool hasRight = stat(right.c_str(), &b) == 0;
+	if (op == "-ef") {
+		return hasLeft && hasRight && a.st_dev == b.st_dev && a.st_ino == b.st_ino;
+	}
+	int order = !hasLeft || !hasRight ? int(hasLeft) - int(hasRight)
+		: a.st_mtim.tv_sec != b.st_mtim.tv_sec ? (a.st_mtim.tv_sec < b.st_mtim.tv_sec ? -1 : 1)
+		: a.st_mtim.tv_nsec != b.st_mtim.tv_nsec ? (a.st_mtim.tv_nsec < b.st_mtim.tv_nsec ? -1 : 1) : 0;
+	return op == "-nt" ? order > 0 : order < 0;
+}
+
+// 'test EXPR' and '[ EXPR ]' with (optionally negated with '!'): STRING, -n|-z STRING, S1 =|==|!= S2,
+// N1 -eq|-ne|-lt|-le|-gt|-ge N2, FILE1 -nt|-ot|-ef FILE2 and -b|-c|-d|-e|-f|-g|-G|-h|-k|-L|-O|-p|-r|-s|-S|-u|-w|-x FILE.
+// Returns 0 when EXPR is true and 1 when it is false. The rest (-a, -o, parentheses, -t, numbers that
+// aren't plain integers) and malformed expressions are declined, the test program handles them.
+int builtinTest(const vector<string>& args, string& out) {
+	size_t end = args.size();
+	if (args[0] == "[") {
+		if (args.back() != "]" || args.size() == 1) {
+			return BUILTIN_DECLINED;
+		}
+		end--;
+	}
+	size_t i = 1;
+	bool negate = false;
+	while (end - i > 1 && args[i] == "!") {
+		negate = !negate;
+		i++;
+	}
+
+	bool result;
+	if (end - i == 0) {
+		result = false;
+	}
+	else if (end - i == 1) {
+		result = !args[i].empty();
+	}
+	else if (end - i == 2) {
+		const string& op = args[i];
+		const string& arg = args[i + 1];
+		if (op == "-n" || op == "-z") {
+			result = arg.empty() == (op == "-z");
+		}
+		else if (!testFile(op, sessionPath(arg), result)) {
+			return BUILTIN_DECLINED;
+		}
+	}
+	else if (end - i == 3) {
+		const string& op = args[i + 1];
+		long long left, right;
+		if (op == "=" || op == "==" || op == "!=") {
+			result = (args[i] == args[i + 2]) == (op != "!=");
+		}
+		else if (op == "-nt" || op == "-ot" || op == "-ef") {
+			result = compareFiles(sessionPath(args[i]), op, sessionPath(args[i + 2]));
+		}
+		else if (op.size() == 3 && op[0] == '-' && parseInteger(args[i], left) && parseInteger(args[i + 2], right)) {
+			// loops test this on every iteration, so compare characters instead of strings
+			switch (op[1] * 256 + op[2]) {
+			case 'e' * 256 + 'q': result = left == right; break;
+			case 'n' * 256 + 'e': result = left != right; break;
+			case 'l' * 256 + 't': result = left < right; break;
+			case 'l' * 256 + 'e': result = left <= right; break;
+			case 'g' * 256 + 't': result = left > right; break;
+			case 'g' * 256 + 'e': result = left >= right; break;
+			default: return BUILTIN_DECLINED;
+			}
+		}
+		else {
+			return BUILTIN_DECLINED;
+		}
+	}
+	else {
+		return BUILTIN_DECLINED;
+	}
+	return result != negate ? 0 : 1;
+}
+
+// returns the builtin called name, or nullptr if there is none
+Builtin findBuiltin(const string& name) {
+	static const struct
+	{
+		const char* name;
+		Builtin builtin;
+	} builtins[] = {
+		{ "echo", builtinEcho },
+		{ "pwd", builtinPwd },
+		{ "true", builtinTrue },
+		{ ":", builtinTrue },
+		{ "false", builtinFalse },
+		{ "test", builtinTest },
+		{ "[", builtinTest },
+	};
+	for (const auto& entry : builtins) {
+		if (name == entry.name) {
+			return entry.builtin;
+		}
+	}
+	return nullptr;
+}
+
+
+// pidfd_open(2), called directly as older C libraries have no wrapper for it
+int pidfdOpen(pid_t pid) {
+	return int(syscall(SYS_pidfd_open, pid, 0));
+}
+
+// (re)arms a one-shot timerfd to fire after ms milliseconds, creating it if fd is -1
+int armTimer(int& fd, long ms) {
+	if (fd < 0 && (fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC)) < 0) {
+		return -1;
+	}
+	struct itimerspec spec = {};
+	spec.it_value.tv_sec = ms / 1000;
+	spec.it_value.tv_nsec = (ms % 1000) * 1000000;
+	return timerfd_settime(fd, 0, &spec, NULL);
+}
+
+void closeFd(int& fd) {
+	if (fd >= 0) {
+		close(fd);
+		fd = -1;
+	}
+}
+
+// translates a waitpid() status into a shell exit status (128 + signal number when killed)
+int exitStatusOf(int status) {
+	if (WIFEXITED(status)) {
+		return WEXITSTATUS(status);
+	}
+	if (WIFSIGNALED(status)) {
+		return 128 + WTERMSIG(status);
+	}
+	return 0;
+}
+
+// Hands the terminal to process group pgid, so keyboard signals (ctrl-c) reach that group.
+// SIGTTOU is blocked meanwhile, as the shell may not be the foreground group when taking it back.
+void giveTerminalTo(pid_t pgid) {
+	sigset_t block, old;
+	sigemptyset(&block);
+	sigaddset(&block, SIGTTOU);
+	sigprocmask(SIG_BLOCK, &block, &old);
+	if (tcsetpgrp(STDIN_FILENO, pgid) < 0) {
+		DEBUGs("tcsetpgrp failed: " << strerror(errno));
+	}
+	sigprocmask(SIG_SETMASK, &old, NULL);
+}
+
+
+bool openJobLog(JobLog& log, size_t size) {
+	if ((log.memfd = memfd_create("joblog", MFD_CLOEXEC)) < 0) {
+		return false;
+	}
+	void* data = MAP_FAILED;
+	if (ftruncate(log.memfd, off_t(size)) == 0) {
+		data = mmap(NULL, size, PROT_READ, MAP_SHARED, log.memfd, 0);
+	}
+	if (data == MAP_FAILED) {
+		closeFd(log.memfd);
+		return false;
+	}
+	log.data = static_cast<char*>(data);
+	log.size = size;
+	return true;
+}
+
+void closeJobLog(JobLog& log) {
+	if (log.data != nullptr) {
+		munmap(log.data, log.size);
+		log.data = nullptr;
+	}
+	closeFd(log.memfd);
+}
+
+// Moves what is available on the (non-blocking) pipe fd into the ring buffer, with splice(2),
+// so the data goes from the pipe into the buffer pages without passing through user space.
+// Returns false once the pipe reached EOF (all writers are gone).
+bool spliceIntoJobLog(JobLog& log, int fd) {
+	while (true) {
+		off64_t offset = off64_t(log.written % log.size);
+		ssize_t bytes = splice(fd, NULL, log.memfd, &offset, log.size - size_t(offset), SPLICE_F_NONBLOCK | SPLICE_F_MOVE);
+		if (bytes > 0) {
+			log.written += uint64_t(bytes);
+			continue;
+		}
+		if (bytes < 0 && errno == EINTR) {
+			continue;
+		}
+		if (bytes < 0 && errno == EAGAIN) {
+			return true;
+		}
+		if (bytes < 0) {
+			DEBUGs("splice into job log failed: " << strerror(errno));
+		}
+		return false;
+	}
+}
+
+// the logged output in order, without what was overwritten already
+string jobLogContents(const JobLog& log) {
+	if (log.written <= log.size) {
+		return string(log.data, size_t(log.written));
+	}
+	size_t start = size_t(log.written % log.size);
+	return string(log.data + start, log.size - start) + string(log.data, start);
+}
+
+
+// Drains the output and reaps the stages of all jobs without blocking.
+// Finished jobs are forgotten, except for the last MAX_FINISHED_JOB_LOGS that have a log.
+void updateJobs() {
+	for (auto& job : session->jobs) {
+		if (job.logfd >= 0 && !spliceIntoJobLog(job.log, job.logfd)) {
+			closeFd(job.logfd);
+		}
+		for (auto& stage : job.stages) {
+			if (!stage.done && waitpid(stage.pid, &stage.status, WNOHANG) == stage.pid) {
+				stage.done = true;
+				job.running--;
+			}
+		}
+	}
+
+	size_t finishedLogs = 0;
+	for (auto job = session->jobs.rbegin(); job != session->jobs.rend(); ++job) {
+		if (job->running == 0 && job->logfd < 0 && job->log.data != nullptr) {
+			finishedLogs++;
+		}
+	}
+	for (auto job = session->jobs.begin(); job != session->jobs.end();) {
+		bool finished = job->running == 0 && job->logfd < 0;
+		bool keepLog = job->log.data != nullptr && finishedLogs <= MAX_FINISHED_JOB_LOGS;
+		if (finished && !keepLog) {
+			if (job->log.data != nullptr) {
+				finishedLogs--;
+			}
+			closeJobLog(job->log);
+			job = session->jobs.erase(job);
+		}
+		else {
+			++job;
+		}
+	}
+}
+
+bool watchJobLog(const Job& job);
+
+// Registers the stages of a background expression as a job.
+// The job takes ownership of logfd, the read end of its output pipe (or -1 when not captured).
+void addJob(const Expression& expression, const vector<StageWait>& stages, int logfd) {
+	Job job;
+	job.id = session->nextJobId++;
+	job.description = describeExpression(expression);
+	job.stages = stages;
+	job.running = stages.size();
+	if (logfd >= 0) {
+		if (fcntl(logfd, F_SETFL, O_NONBLOCK) == 0 && openJobLog(job.log, JOB_LOG_SIZE)) {
+			job.logfd = logfd;
+		}
+		else {
+			*session->err << "could not set up the job log: " << strerror(errno) << endl;
+			close(logfd);
+		}
+	}
+	session->jobs.push_back(job);
+	if (job.logfd >= 0) {
+		DEBUGs("[" << job.id << "] logging output of " << job.description);
+	}
+	// an embedded session has no prompt to drain it at (see waitForInput), Shell::poll() does then
+	if (job.logfd >= 0 && session->embedded) {
+		watchJobLog(job);
+	}
+}
+
+// Blocks until there is input for the next command line, meanwhile draining the output of
+// captured jobs, so they don't stall on a full pipe while the shell sits at its prompt.
+// Lines cin has read already are input too (cin has a buffer of its own, see shell()).
+void waitForInput() {
+	if (cin.rdbuf()->in_avail() > 0) {
+		return;
+	}
+	vector<pollfd> fds;
+	while (true) {
+		fds.clear();
+		fds.push_back({ STDIN_FILENO, POLLIN, 0 });
+		for (const auto& job : session->jobs) {
+			if (job.logfd >= 0) {
+				fds.push_back({ job.logfd, POLLIN, 0 });
+			}
+		}
+		if (fds.size() == 1) {
+			return;
+		}
+		if (poll(fds.data(), fds.size(), -1) < 0 && errno != EINTR) {
+			return;
+		}
+		updateJobs();
+		if (fds[0].revents != 0) {
+			return;
+		}
+	}
+}
+
+// Handle a 'joblog' command:
+//   joblog            lists the jobs
+//   joblog on|off     starts/stops capturing the output of new background jobs
+//   joblog ID         prints the captured output of job ID
+//   joblog ID FILE    writes it to FILE instead
+int handleJobLog(const Command& cmd) {
+	updateJobs();
+	if (cmd.parts.size() == 1) {
+		for (const auto& job : session->jobs) {
+			*session->out << "[" << job.id << "] ";
+			if (job.running > 0) {
+				*session->out << "running";
+			}
+			else {
+				*session->out << "done " << exitStatusOf(job.stages.back().status);
+			}
+			if (job.log.data != nullptr) {
+				*session->out << ", " << job.log.written << " bytes logged";
+			}
+			*session->out << "\t" << job.description << endl;
+		}
+		return BUILTIN_FLAG;
+	}
+	if (cmd.parts.size() == 2 && (cmd.parts[1] == "on" || cmd.parts[1] == "off")) {
+		session->jobLogging = cmd.parts[1] == "on";
+		return BUILTIN_FLAG;
+	}
+
+	const Job* job = nullptr;
+	for (const auto& candidate : session->jobs) {
+		if (cmd.parts.size() <= 3 && to_string(candidate.id) == cmd.parts[1]) {
+			job = &candidate;
+		}
+	}
+	if (job == nullptr || job->log.data == nullptr) {
+		*session->err << "Usage: joblog [on|off|ID [FILE]] (ID must be a job with a log)" << endl;
+		return BUILTIN_FLAG;
+	}
+	if (job->log.written > job->log.size) {
+		*session->err << "(first " << job->log.written - job->log.size << " bytes of output dropped)" << endl;
+	}
+	string contents = jobLogContents(job->log);
+	if (cmd.parts.size() == 2) {
+		*session->out << contents;
+		flush(*session->out);
+		return BUILTIN_FLAG;
+	}
+
+	int FileOutputModeFlag = O_WRONLY | O_CREAT | O_EXCL | O_TRUNC | O_CLOEXEC;
+	int fd = open(sessionPath(cmd.parts[2]).c_str(), FileOutputModeFlag, 0644);
+	if (fd < 0) {
+		*session->err << "opening file error for " << cmd.parts[2] << endl;
+		*session->err << strerror(errno) << endl;
+		return BUILTIN_FLAG;
+	}
+	for (size_t done = 0; done < contents.size();) {
+		ssize_t bytes = write(fd, contents.data() + done, contents.size() - done);
+		if (bytes < 0 && errno != EINTR) {
+			*session->err << "writing " << cmd.parts[2] << " failed" << endl;
+			*session->err << strerror(errno) << endl;
+			break;
+		}
+		done += bytes > 0 ? size_t(bytes) : 0;
+	}
+	close(fd);
+	return BUILTIN_FLAG;
+}
+
+// reads what is available on a capture pipe into buffer. Returns false once the pipe is drained (EOF).
+bool drainCapture(int fd, string& buffer) {
+	char chunk[65536];
+	ssize_t bytes = read(fd, chunk, sizeof(chunk));
+	if (bytes < 0 && (errno == EINTR || errno == EAGAIN)) {
+		return true;
+	}
+	if (bytes <= 0) {
+		return false;
+	}
+	buffer.append(chunk, size_t(bytes));
+	return true;
+}
+
+// what a pollfd (or epoll event) of a pipeline is: a stage exiting, a stage timeout, the deadline,
+// captured output or errors, or the output of a background job
+enum PollKind { STAGE_EXIT, STAGE_TIMER, DEADLINE, CAPTURE, ERRORS, JOB_LOG };
+
+// sends sig to a stage, through its process group when it has one (see spawnStages)
+void signalStage(const StageWait& stage, int sig) {
+	kill(stage.group != 0 ? -stage.group : stage.pid, sig);
+}
+
+// sends sig to the pipeline in process group pgid, or to each of its running stages when it has no group of its own
+void signalPipeline(const vector<StageWait>& stages, pid_t pgid, int sig) {
+	if (pgid != 0) {
+		kill(-pgid, sig);
+		return;
+	}
+	for (const auto& stage : stages) {
+		if (!stage.done) {
+			signalStage(stage, sig);
+		}
+	}
+}
+
+// The 'timeout' timer of a stage fired: it gets SIGTERM, then SIGKILL when the timer fires again KILL_GRACE_MS later.
+void stageTimerFired(StageWait& stage) {
+	uint64_t expirations;
+	if (read(stage.timerfd, &expirations, sizeof(expirations)) < 0) {
+		return;
+	}
+	if (!stage.termSent) {
+		stage.termSent = stage.timedOut = true;
+		session->metrics.stageTimeouts++;
+		DEBUGs("timeout expired for " << stage.pid);
+		signalStage(stage, SIGTERM);
+		armTimer(stage.timerfd, KILL_GRACE_MS);
+	}
+	else {
+		session->metrics.kills++;
+		signalStage(stage, SIGKILL);
+		closeFd(stage.timerfd);
+	}
+}
+
+// The deadline of the pipeline in process group pgid fired: the pipeline gets SIGTERM (see signalPipeline),
+// then SIGKILL when the deadline fires again KILL_GRACE_MS later.
+void deadlineFired(vector<StageWait>& stages, pid_t pgid, int& deadlinefd, bool& deadlineExpired) {
+	uint64_t expirations;
+	if (read(deadlinefd, &expirations, sizeof(expirations)) < 0) {
+		return;
+	}
+	if (!deadlineExpired) {
+		deadlineExpired = true;
+		session->metrics.deadlinesExpired++;
+		DEBUGs("deadline expired, terminating the pipeline");
+		for (auto& stage : stages) {
+			stage.timedOut = stage.timedOut || !stage.done;
+		}
+		signalPipeline(stages, pgid, SIGTERM);
+		armTimer(deadlinefd, KILL_GRACE_MS);
+	}
+	else {
+		session->metrics.kills++;
+		signalPipeline(stages, pgid, SIGKILL);
+		closeFd(deadlinefd);
+	}
+}
+
+// Reaps stage i once its pidfd became readable. Returns false when it has not exited after all.
+bool reapStage(vector<StageWait>& stages, size_t i) {
+	StageWait& stage = stages[i];
+	if (wait4(stage.pid, &stage.status, WNOHANG, &stage.usage) != stage.pid) {
+		return false;
+	}
+	DEBUG("reaped pid: " << stage.pid);
+	stage.done = true;
+	closeFd(stage.pidfd);
+	closeFd(stage.timerfd);
+	// a satisfied 'head' won't read anything anymore, and the optimizer only lets it stop
+	// stages before it that do nothing but write output (see optimizeExpression)
+	if (stage.stopsUpstream) {
+		for (size_t k = 0; k < i; k++) {
+			if (!stages[k].done) {
+				kill(stages[k].pid, SIGPIPE);
+			}
+		}
+	}
+	return true;
+}
+
+// exit status of a pipeline after all its stages were reaped
+int pipelineStatus(const vector<StageWait>& stages, bool deadlineExpired) {
+	if (deadlineExpired || stages.back().timedOut) {
+		return TIMEOUT_EXIT_STATUS;
+	}
+	return exitStatusOf(stages.back().status);
+}
+
+// appends a StageResult for each of the reaped stages of expression to results
+void addStageResults(const Expression& expression, const vector<StageWait>& stages, vector<StageResult>& results) {
+	for (size_t i = 0; i < stages.size(); i++) {
+		StageResult result;
+		result.command = expression.commands[i].parts;
+		result.status = stages[i].timedOut ? TIMEOUT_EXIT_STATUS : exitStatusOf(stages[i].status);
+		result.usage = stages[i].usage;
+		results.push_back(result);
+	}
+}
+
+// Reaps the stages of a foreground pipeline from one poll() loop over their pidfds and timerfds.
+// - a stage whose own 'timeout' expires gets SIGTERM
+// - when the expression deadline expires the whole pipeline gets SIGTERM
+// both are followed up by SIGKILL when the target is still alive KILL_GRACE_MS later.
+// When capturefd is given, the output arriving on it is appended to capture until EOF,
+// and the same goes for errorfd and errors.
+// The output of captured background jobs is drained meanwhile as well.
+// Returns the exit status of the expression: that of the last stage, or TIMEOUT_EXIT_STATUS on expiry.
+int waitForStages(vector<StageWait>& stages, pid_t pgid, long deadlineMs, int capturefd = -1, string* capture = nullptr,
+	int errorfd = -1, string* errors = nullptr) {
+	for (auto& stage : stages) {
+		if ((stage.pidfd = pidfdOpen(stage.pid)) < 0) {
+			// no pidfd support (pre 5.3 kernel): fall back to plain blocking waits without deadlines
+			DEBUGs("pidfd_open failed, deadlines are not enforced: " << strerror(errno));
+			while (capturefd >= 0 || errorfd >= 0) {
+				pollfd fds[] = { { capturefd, POLLIN, 0 }, { errorfd, POLLIN, 0 } };
+				if (poll(fds, 2, -1) < 0 && errno != EINTR) {
+					break;
+				}
+				if (fds[0].revents != 0 && !drainCapture(capturefd, *capture)) {
+					capturefd = -1;
+				}
+				if (fds[1].revents != 0 && !drainCapture(errorfd, *errors)) {
+					errorfd = -1;
+				}
+			}
+			for (auto& s : stages) {
+				closeFd(s.pidfd);
+				closeFd(s.timerfd);
+				if (wait4(s.pid, &s.status, 0, &s.usage) < 0) {
+					*session->err << "waitpid error for " << s.pid << endl;
+					*session->err << strerror(errno) << endl;
+				}
+				s.done = true;
+			}
+			return exitStatusOf(stages.back().status);
+		}
+		if (stage.timeoutMs > 0 && armTimer(stage.timerfd, stage.timeoutMs) < 0) {
+			*session->err << "could not arm timeout for " << stage.pid << endl;
+			*session->err << strerror(errno) << endl;
+		}
+	}
+
+	int deadlinefd = -1;
+	bool deadlineExpired = false;
+	if (deadlineMs > 0 && armTimer(deadlinefd, deadlineMs) < 0) {
+		*session->err << "could not arm deadline" << endl;
+		*session->err << strerror(errno) << endl;
+	}
+
+	struct PollSource
+	{
+		PollKind kind;
+		int stage;
+	};
+	vector<pollfd> fds;
+	vector<PollSource> sources;
+	size_t running = stages.size();
+	while (running > 0 || capturefd >= 0 || errorfd >= 0) {
+		fds.clear();
+		sources.clear();
+		for (size_t i = 0; i < stages.size(); i++) {
+			if (stages[i].done) {
+				continue;
+			}
+			fds.push_back({ stages[i].pidfd, POLLIN, 0 });
+			sources.push_back({ STAGE_EXIT, int(i) });
+			if (stages[i].timerfd >= 0) {
+				fds.push_back({ stages[i].timerfd, POLLIN, 0 });
+				sources.push_back({ STAGE_TIMER, int(i) });
+			}
+		}
+		if (deadlinefd >= 0) {
+			fds.push_back({ deadlinefd, POLLIN, 0 });
+			sources.push_back({ DEADLINE, -1 });
+		}
+		if (capturefd >= 0) {
+			fds.push_back({ capturefd, POLLIN, 0 });
+			sources.push_back({ CAPTURE, -1 });
+		}
+		if (errorfd >= 0) {
+			fds.push_back({ errorfd, POLLIN, 0 });
+			sources.push_back({ ERRORS, -1 });
+		}
+		for (const auto& job : session->jobs) {
+			if (job.logfd >= 0) {
+				fds.push_back({ job.logfd, POLLIN, 0 });
+				sources.push_back({ JOB_LOG, -1 });
+			}
+		}
+
+		if (poll(fds.data(), fds.size(), -1) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			*session->err << "poll error while waiting for children" << endl;
+			*session->err << strerror(errno) << endl;
+			break;
+		}
+
+		for (size_t j = 0; j < fds.size(); j++) {
+			if (fds[j].revents == 0) {
+				continue;
+			}
+			if (sources[j].kind == CAPTURE) {
+				if (!drainCapture(capturefd, *capture)) {
+					capturefd = -1; // the caller owns (and closes) the fd
+				}
+				continue;
+			}
+			if (sources[j].kind == ERRORS) {
+				if (!drainCapture(errorfd, *errors)) {
+					errorfd = -1;
+				}
+				continue;
+			}
+			if (sources[j].kind == JOB_LOG) {
+				// this drains (and reaps) all jobs at once, so skip the other job pipes of this round
+				updateJobs();
+				while (j + 1 < fds.size() && sources[j + 1].kind == JOB_LOG) {
+					j++;
+				}
+				continue;
+			}
+			if (sources[j].kind == DEADLINE) {
+				// the deadline of the whole expression expired
+				deadlineFired(stages, pgid, deadlinefd, deadlineExpired);
+				continue;
+			}
+
+			StageWait& stage = stages[sources[j].stage];
+			if (stage.done) {
+				continue;
+			}
+			if (sources[j].kind == STAGE_TIMER) {
+				stageTimerFired(stage);
+			}
+			else if (reapStage(stages, size_t(sources[j].stage))) {
+				running--;
+			}
+		}
+	}
+
+	closeFd(deadlinefd);
+	for (auto& stage : stages) {
+		closeFd(stage.pidfd);
+		closeFd(stage.timerfd);
+	}
+	return pipelineStatus(stages, deadlineExpired);
+}
+
+
+// writes text to stderr with plain write(2) calls, for a child between fork and exec
+void writeFromChild(const char* text) {
+	for (size_t length = strlen(text); length > 0;) {
+		ssize_t bytes = write(STDERR_FILENO, text, length);
+		if (bytes < 0 && errno == EINTR) {
+			continue;
+		}
+		if (bytes <= 0) {
+			return;
+		}
+		text += bytes;
+		length -= size_t(bytes);
+	}
+}
+
+void writeNumberFromChild(long number) {
+	char digits[24];
+	char* start = digits + sizeof(digits) - 1;
+	*start = '\0';
+	do {
+		*--start = char('0' + number % 10);
+		number /= 10;
+	} while (number > 0);
+	writeFromChild(start);
+}
+
+// Reports why a child failed before exec ('what detail number' and the error in errno), then exits
+// with status. It only makes async-signal-safe calls, see spawnStages.
+[[noreturn]] void childFailed(int status, const char* what, const char* detail = "", long number = -1) {
+	int error = errno;
+	writeFromChild(what);
+	writeFromChild(detail);
+	if (number >= 0) {
+		writeNumberFromChild(number);
+	}
+	writeFromChild("\n");
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 32))
+	// a static table, unlike strerror which may translate the message
+	const char* description = strerrordesc_np(error);
+	writeFromChild(description != nullptr ? description : "unknown error");
+#else
+	writeFromChild("error ");
+	writeNumberFromChild(error);
+#endif
+	writeFromChild("\n");
+	_exit(status);
+}
+
+// Starts the stages of an expression
+// - check for inputfile, get/set corresponding input filedescriptor
+// - create pipes to connect child processes from fork()
+// - get outputfile file descriptors (in overwrite mode!) when needed
+// - execute commands with execvp in a child process. When the pipeline gets the terminal, they all
+//   run in a process group of their own (pgid), otherwise they stay in the shell's group (pgid is 0 then),
+//   so signals sent to the shell's group (like the ones of a supervisor killing it) reach them too.
+//   A stage with a 'timeout' leads a group of its own then, to be signalled with everything it started.
+// - when stdoutfd is given, the last stage writes there (unless the output goes to a file),
+//   when stderrfd is given all stages write their errors there.
+// Returns -1 when the stages could not all be started, the ones that were are killed and reaped then.
+int spawnStages(Expression& expression, int stdoutfd, int stderrfd, vector<StageWait>& stages, pid_t& pgid) {
+	int AMT_COMMANDS = expression.commands.size();
+	int LAST = AMT_COMMANDS - 1;
+
+	int pipefd[2];
+	int inputfd, outputfd;
+
+	// Close-on-exec, like the pipes: sessions on other threads fork too, and their children must not keep
+	// our pipes open (a reader would never see EOF then). dup2() clears it on the fds a child is given.
+	int FileInputModeFlag = O_RDONLY | O_CLOEXEC;
+	int FileOutputModeFlag = O_WRONLY | O_CREAT | O_EXCL | O_TRUNC;
+
+	mode_t writePermissions = 0644;
+
+	pid_t cpid;
+	pgid = 0; // process group of the pipeline, the pid of its first child (0: the shell's group)
+	// a foreground pipeline of the interactive shell gets the terminal (see executeCommands)
+	bool takeTerminal = !expression.background && !session->embedded && isatty(STDIN_FILENO)
+		&& tcgetpgrp(STDIN_FILENO) == getpgrp();
+
+	// Everything a child needs is prepared here, as it must not allocate (or take any lock) between
+	// fork() and exec: an embedded session may run in a program with other threads, and one of them
+	// may have held such a lock at the time of the fork. That includes the output of builtin stages
+	// (builtins only produce output, so running them up front makes no difference).
+	vector<vector<const char*>> argvs(AMT_COMMANDS);
+	vector<string> builtinOutputs(AMT_COMMANDS);
+	vector<int> builtinStatuses(AMT_COMMANDS, 0);
+	for (int i = 0; i < AMT_COMMANDS; i++) {
+		Command& command = expression.commands[i];
+		if (command.runAsBuiltin) {
+			builtinStatuses[i] = findBuiltin(command.parts[0])(command.parts, builtinOutputs[i]);
+			// a builtin that declines its arguments leaves them to the program (see Builtin)
+			command.runAsBuiltin = builtinStatuses[i] != BUILTIN_DECLINED;
+		}
+		for (const auto& part : command.parts) {
+			argvs[i].push_back(part.c_str());
+		}
+		argvs[i].push_back(nullptr);
+	}
+
+	// If an input file is given, create a filedescriptor and set it as input
+	if (expression.inputFromFile.empty() == 0) {
+		if ((inputfd = open(sessionPath(expression.inputFromFile).c_str(), FileInputModeFlag)) < 0) {
+			// handle errors
+			*session->err << "fail when opening filedescriptor for " << expression.inputFromFile.c_str() << endl;
+			*session->err << strerror(errno) << endl;
+			return -1;
+		}
+		DEBUGs("Created inputfd " << inputfd << " for " << expression.inputFromFile.c_str());
+	}
+	// Otherwise, we set the first inputfd to 0
+	else {
+		inputfd = STDIN_FILENO;
+	}
+
+	// out of pipes or processes: stop the stages that are running already, a pipeline is all or nothing
+	auto abandon = [&]() {
+		if (inputfd != STDIN_FILENO) {
+			close(inputfd);
+		}
+		signalPipeline(stages, pgid, SIGKILL);
+		for (auto& stage : stages) {
+			waitpid(stage.pid, &stage.status, 0);
+		}
+		stages.clear();
+		return -1;
+	};
+
+	for (int i = 0; i < AMT_COMMANDS; i++) {
+		if (i != LAST) {
+			// if there are more processes to be started, 
+			// we create a pipe to redirect their I/Os
+			if (pipe2(pipefd, O_CLOEXEC) != 0) {
+				*session->err << "Failed to create pipe!\n";
+				*session->err << strerror(errno) << endl;
+				return abandon();
+			}
+		}
+
+		// create child process. 
+		if ((cpid = fork()) < 0) {
+			*session->err << "fork failed" << endl;
+			*session->err << strerror(errno) << endl;
+			if (i != LAST) {
+				close(pipefd[0]);
+				close(pipefd[1]);
+			}
+			return abandon();
+		}
+
+
+		if (cpid == 0) {
+			// child part of loop 
+			DEBUG("cpid " << getpid() << " started with input: " << inputfd);
+			// join the pipeline's process group (the first child creates it), so it can be signalled as a whole
+			if (takeTerminal) {
+				setpgid(0, pgid);
+			}
+			else if (expression.commands[i].timeoutMs > 0) {
+				setpgid(0, 0);
+			}
+			if (!session->embedded) {
+				// The shell has no job control: a stopped stage would never be resumed (and its pidfd
+				// doesn't report stops), so ctrl-z and reading or writing the terminal from the
+				// background must not stop it. This is inherited through exec.
+				signal(SIGTSTP, SIG_IGN);
+				signal(SIGTTIN, SIG_IGN);
+				signal(SIGTTOU, SIG_IGN);
+			}
+			// take the terminal right away too, the shell may not have given it yet when this stage reads it
+			if (takeTerminal) {
+				tcsetpgrp(STDIN_FILENO, pgid == 0 ? getpid() : pgid);
+			}
+			if (!session->cwd.empty() && chdir(session->cwd.c_str()) < 0) {
+				childFailed(1, "chdir failed to ", session->cwd.c_str());
+			}
+			if (inputfd != STDIN_FILENO) {
+				// replace stdin of child process with the output from previous pipe
+				// or in case of an inputfile, set that as the stdin.
+				if (dup2(inputfd, STDIN_FILENO) < 0) {
+					childFailed(1, "dup2(inputfd, STDIN) failed, inputfd ", "", inputfd);
+				}
+				// clear resources
+				if (close(inputfd) < 0) {
+					childFailed(1, "fail when closing inputfd ", "", inputfd);
+				}
+			}
+			// an embedded session has no input to give, it must not read the input of the program it runs in
+			else if (session->embedded) {
+				int nullfd = open("/dev/null", O_RDONLY);
+				if (nullfd < 0 || dup2(nullfd, STDIN_FILENO) < 0) {
+					childFailed(1, "could not read from /dev/null");
+				}
+				close(nullfd);
+			}
+
+			if (i != LAST) {
+				// (skips last child)
+				// child processes should redirect their stdout
+				// to the input end of the next pipe
+				if (dup2(pipefd[1], STDOUT_FILENO) < 0) {
+					childFailed(1, "dup2(fd[1], STDOUT) failed, fd[1] ", "", pipefd[1]);
+				}
+				if (close(pipefd[1]) < 0) {
+					childFailed(1, "fail when closing pipefd[1] ", "", pipefd[1]);
+				}
+				// the read end belongs to the next child
+				close(pipefd[0]);
+			}
+			// if an outputfile is given
+			else if (i == LAST && (expression.outputToFile.empty() == 0)) {
+				// open a fd for the output file in write or read/write mode
+				// not sure if its the right option to do this here, instead of
+				// above the whole for-loop
+				// O_WRONLY | O_TRUNC | O_CREAT | O_EXCL
+				if ((outputfd = open(expression.outputToFile.c_str(), FileOutputModeFlag, writePermissions)) < 0) {
+					childFailed(1, "opening file error for ", expression.outputToFile.c_str());
+				}
+				if (dup2(outputfd, STDOUT_FILENO) < 0) {
+					childFailed(1, "dup2(outputfd, STDOUT) failed, outputfd ", "", outputfd);
+				}
+				if (close(outputfd) < 0) {
+					childFailed(1, "fail when closing outputfd ", "", outputfd);
+				}
+			}
+			// otherwise the output of a command substitution or logged job goes to the shell
+			else if (i == LAST && stdoutfd >= 0) {
+				if (dup2(stdoutfd, STDOUT_FILENO) < 0) {
+					childFailed(1, "dup2(stdoutfd, STDOUT) failed");
+				}
+			}
+			if (stderrfd >= 0 && dup2(stderrfd, STDERR_FILENO) < 0) {
+				childFailed(1, "dup2(stderrfd, STDERR) failed");
+			}
+
+			// Execute the commands! We expect the child not to return from execvp,
+			// as the process should be replaced by it.
+			// a builtin stage only writes the output the shell produced for it (see optimizeExpression)
+			if (expression.commands[i].runAsBuiltin) {
+				const string& output = builtinOutputs[i];
+				for (size_t done = 0; done < output.size();) {
+					ssize_t bytes = write(STDOUT_FILENO, output.data() + done, output.size() - done);
+					if (bytes < 0 && errno != EINTR) {
+						_exit(1);
+					}
+					done += bytes > 0 ? size_t(bytes) : 0;
+				}
+				_exit(builtinStatuses[i]);
+			}
+
+			if (argvs[i][0] == nullptr) {
+				errno = EINVAL;
+			}
+			else {
+				execvp(argvs[i][0], const_cast<char**>(argvs[i].data()));
+			}
+			// like other shells: 127 when there is no such command, 126 when it can't be executed
+			childFailed(errno == ENOENT || errno == EINVAL ? 127 : 126, "encountered a bad command: ", expression.commands[i].parts.empty() ? "" : expression.commands[i].parts[0].c_str());
+		}
+		// parent part of the loop
+		else {
+			// also set the group from the parent, so it exists before anyone signals it
+			pid_t group = 0;
+			if (takeTerminal) {
+				if (pgid == 0) {
+					pgid = cpid;
+				}
+				setpgid(cpid, pgid);
+				// a stage on its own can take its group along when it times out, in a longer pipeline
+				// that would take the other stages too
+				group = AMT_COMMANDS == 1 ? pgid : 0;
+			}
+			else if (expression.commands[i].timeoutMs > 0) {
+				setpgid(cpid, cpid);
+				group = cpid;
+			}
+
+			// the child has its own copy of the input now. Keeping ours open would keep
+			// the pipe alive after its reader exits, so a writer never gets SIGPIPE.
+			if (inputfd != STDIN_FILENO && close(inputfd) < 0) {
+				*session->err << i << " fail when closing inputfd in parent: " << inputfd << endl;
+				*session->err << strerror(errno) << endl;
+			}
+
+			// make the new input the output of the pipe we have
+			if (i != LAST) {
+				inputfd = pipefd[0];
+
+				// close the write end of this pipe
+				if (close(pipefd[1]) < 0) {
+					*session->err << i << " fail when closing fd in parent: " << pipefd[1] << endl;
+					*session->err << strerror(errno) << endl;
+				}
+			}
+
+			// administration
+			// question: should/could be skipped if exp.background=true?
+			StageWait stage;
+			stage.pid = cpid;
+			stage.group = group;
+			stage.timeoutMs = expression.commands[i].timeoutMs;
+			stage.stopsUpstream = expression.commands[i].stopsUpstream;
+			stages.push_back(stage);
+		}
+	}
+	session->metrics.pipelines++;
+	session->metrics.stages += AMT_COMMANDS;
+	return 0;
+}
+
+bool watchPipeline(const Expression& expression, vector<StageWait>& stages, pid_t pgid, int capturefd, int errorfd);
+
+// Execute an expression
+// - start its stages (see spawnStages)
+// - wait for child process pids at the end if this is not a background expression,
+//   enforcing 'timeout' prefixes and the expression deadline (see waitForStages).
+// - when capture is given, the last stage writes to a pipe that is read into capture
+//   (unless the output goes to a file), for command substitution.
+// - background expressions become jobs. With 'joblog on' the output (and errors)
+//   of all their stages go to a pipe that the shell drains into the job log.
+// - in an embedded session (see Session::embedded) the output and errors of the stages are
+//   collected into the session's out and err (background jobs always get a job log there).
+// - an expression of Shell::submit() is not waited for, the session's epoll loop takes it (see watchPipeline)
+int executeCommands(Expression& expression, string* capture = nullptr) {
+	bool submitting = session->submitted != nullptr && capture == nullptr;
+	string output, errors;
+	if (session->embedded && capture == nullptr && !expression.background) {
+		capture = &output;
+	}
+
+	// close-on-exec, so only the children that dup2 the write end keep it open
+	bool logJob = expression.background && (session->jobLogging || session->embedded) && capture == nullptr;
+	int capturefd[2] = { -1, -1 };
+	int errorfd[2] = { -1, -1 };
+	if (((capture != nullptr || logJob) && pipe2(capturefd, O_CLOEXEC) != 0)
+		|| (session->embedded && !logJob && pipe2(errorfd, O_CLOEXEC) != 0)) {
+		*session->err << "Failed to create capture pipe!" << endl;
+		*session->err << strerror(errno) << endl;
+		closeFd(capturefd[0]);
+		closeFd(capturefd[1]);
+		return -1;
+	}
+
+	vector<StageWait> stages;
+	pid_t pgid;
+	// a logged job keeps its errors off the terminal too
+	int rc = spawnStages(expression, capturefd[1], logJob ? capturefd[1] : errorfd[1], stages, pgid);
+	// only the last child may hold the write end, or we would never see EOF
+	closeFd(capturefd[1]);
+	closeFd(errorfd[1]);
+	if (rc != 0) {
+		closeFd(capturefd[0]);
+		closeFd(errorfd[0]);
+		return rc;
+	}
+
+	if (submitting && watchPipeline(expression, stages, pgid, capturefd[0], errorfd[0])) {
+		return 0;
+	}
+
+	// wait for children to finish their processing
+	// (skips if expression.background=true)
+	if (!expression.background) {
+		// a foreground pipeline gets the terminal, so ctrl-c stops the pipeline and not the shell
+		// (spawnStages only gives it a process group of its own then)
+		bool ownTerminal = pgid != 0;
+		if (ownTerminal) {
+			giveTerminalTo(pgid);
+		}
+		session->lastExitStatus = waitForStages(stages, pgid, expression.deadlineMs, capturefd[0], capture, errorfd[0], &errors);
+		if (ownTerminal) {
+			giveTerminalTo(getpgrp());
+		}
+		if (session->stageResults != nullptr) {
+			addStageResults(expression, stages, *session->stageResults);
+		}
+		DEBUG("waited for all pid, returning");
+	}
+	else {
+		addJob(expression, stages, capturefd[0]);
+		capturefd[0] = -1;
+	}
+	closeFd(capturefd[0]);
+	closeFd(errorfd[0]);
+	*session->out << output;
+	*session->err << errors;
+
+	return 0;
+}
+
+// epoll_event.data of the fd of a submitted pipeline: the pipeline id, what the fd is (a PollKind) and the stage it belongs to
+uint64_t pipelineEventData(unsigned long id, PollKind kind, size_t stage) {
+	return (uint64_t(id) << 24) | (uint64_t(kind) << 16) | uint64_t(stage);
+}
+
+bool watchFd(int fd, uint64_t data) {
+	struct epoll_event event = {};
+	event.events = EPOLLIN;
+	event.data.u64 = data;
+	return epoll_ctl(session->epollfd, EPOLL_CTL_ADD, fd, &event) == 0;
+}
+
+// creates the epoll instance of the session (see Shell::poll()) when it has none yet
+bool openSessionEpoll() {
+	if (session->epollfd < 0 && (session->epollfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+		DEBUGs("epoll_create1 failed: " << strerror(errno));
+		return false;
+	}
+	return true;
+}
+
+// Adds the output pipe of a logged job to the epoll loop of the session, which drains it (see handlePipelineEvent).
+// Closing the pipe at EOF takes it out again.
+bool watchJobLog(const Job& job) {
+	return openSessionEpoll() && watchFd(job.logfd, pipelineEventData(job.id, JOB_LOG, 0));
+}
+
+// Hands the started stages of a submitted expression to the epoll loop of the session (see Shell::poll()),
+// which reaps them and reads their output (capturefd) and errors (errorfd). The pipeline takes the fds.
+// Returns false when it can't be watched (no pidfd support), the caller has to wait for it instead then.
+bool watchPipeline(const Expression& expression, vector<StageWait>& stages, pid_t pgid, int capturefd, int errorfd) {
+	if (!openSessionEpoll()) {
+		return false;
+	}
+	for (auto& stage : stages) {
+		if ((stage.pidfd = pidfdOpen(stage.pid)) < 0) {
+			DEBUGs("pidfd_open failed, waiting for the submitted expression: " << strerror(errno));
+			for (auto& s : stages) {
+				closeFd(s.pidfd);
+			}
+			return false;
+		}
+	}
+
+	unsigned long id = session->nextPipelineId++;
+	AsyncPipeline& pipeline = session->pipelines[id];
+	pipeline.expression = expression;
+	pipeline.stages.swap(stages);
+	pipeline.pgid = pgid;
+	pipeline.running = pipeline.stages.size();
+	pipeline.capturefd = capturefd;
+	pipeline.errorfd = errorfd;
+	pipeline.done = move(*session->submitted);
+	session->submitted = nullptr;
+
+	bool watching = true;
+	for (size_t i = 0; i < pipeline.stages.size(); i++) {
+		StageWait& stage = pipeline.stages[i];
+		watching = watching && watchFd(stage.pidfd, pipelineEventData(id, STAGE_EXIT, i));
+		if (stage.timeoutMs > 0 && armTimer(stage.timerfd, stage.timeoutMs) == 0) {
+			watching = watching && watchFd(stage.timerfd, pipelineEventData(id, STAGE_TIMER, i));
+		}
+	}
+	if (expression.deadlineMs > 0 && armTimer(pipeline.deadlinefd, expression.deadlineMs) == 0) {
+		watching = watching && watchFd(pipeline.deadlinefd, pipelineEventData(id, DEADLINE, 0));
+	}
+	if (capturefd >= 0) {
+		watching = watching && watchFd(capturefd, pipelineEventData(id, CAPTURE, 0));
+	}
+	if (errorfd >= 0) {
+		watching = watching && watchFd(errorfd, pipelineEventData(id, ERRORS, 0));
+	}
+	if (!watching) {
+		// epoll is out of room: kill the pipeline right away instead of leaving processes behind nobody reaps
+		pipeline.result.err += string("could not watch the submitted pipeline: ") + strerror(errno) + "\n";
+		pipeline.result.status = 1;
+		signalPipeline(pipeline.stages, pgid, SIGKILL);
+		for (auto& stage : pipeline.stages) {
+			closeFd(stage.pidfd);
+			closeFd(stage.timerfd);
+			waitpid(stage.pid, &stage.status, 0);
+		}
+		closeFd(pipeline.capturefd);
+		closeFd(pipeline.errorfd);
+		closeFd(pipeline.deadlinefd);
+		session->finished.emplace_back(move(pipeline.done), move(pipeline.result));
+		session->pipelines.erase(id);
+	}
+	return true;
+}
+
+// Handles an epoll event of a submitted pipeline (see pipelineEventData). A pipeline that is done, all its
+// stages reaped and its pipes at EOF, moves to completions. The event of a logged job (see watchJobLog)
+// drains the output of the jobs and reaps the ones that finished.
+void handlePipelineEvent(uint64_t data, vector<pair<ShellCompletion, ShellResult>>& completions) {
+	PollKind kind = PollKind((data >> 16) & 0xff);
+	if (kind == JOB_LOG) {
+		updateJobs();
+		return;
+	}
+	auto found = session->pipelines.find(data >> 24);
+	if (found == session->pipelines.end()) {
+		return; // completed already, by an earlier event of this round
+	}
+	AsyncPipeline& pipeline = found->second;
+	size_t stage = data & 0xffff;
+	switch (kind) {
+	case STAGE_EXIT:
+		if (!pipeline.stages[stage].done && reapStage(pipeline.stages, stage)) {
+			pipeline.running--;
+		}
+		break;
+	case STAGE_TIMER:
+		if (!pipeline.stages[stage].done) {
+			stageTimerFired(pipeline.stages[stage]);
+		}
+		break;
+	case DEADLINE:
+		deadlineFired(pipeline.stages, pipeline.pgid, pipeline.deadlinefd, pipeline.deadlineExpired);
+		break;
+	case CAPTURE:
+		if (!drainCapture(pipeline.capturefd, pipeline.result.out)) {
+			closeFd(pipeline.capturefd);
+		}
+		break;
+	case ERRORS:
+		if (!drainCapture(pipeline.errorfd, pipeline.result.err)) {
+			closeFd(pipeline.errorfd);
+		}
+		break;
+	case JOB_LOG:
+		break; // (handled above)
+	}
+
+	if (pipeline.running > 0 || pipeline.capturefd >= 0 || pipeline.errorfd >= 0) {
+		return;
+	}
+	closeFd(pipeline.deadlinefd);
+	pipeline.result.status = pipelineStatus(pipeline.stages, pipeline.deadlineExpired);
+	addStageResults(pipeline.expression, pipeline.stages, pipeline.result.stages);
+	completions.emplace_back(move(pipeline.done), move(pipeline.result));
+	session->pipelines.erase(found);
+}
+
+// value of shell variable (or else environment variable) name, empty when it is not set
+string variableValue(const string& name) {
+	auto found = session->variables.find(name);
+	if (found != session->variables.end()) {
+		return found->second;
+	}
+	const char* value = getenv(name.c_str());
+	return value != NULL ? value : "";
+}
+
+// Evaluator for $(( )) over long long integers, by precedence climbing. Binary operators from low to high
+// precedence: ||, &&, == !=, < <= > >=, + -, * / %. Operands are numbers, variable names (unset is 0),
+// ( ) and the unary ! - +.
+struct Arithmetic
+{
+	const string& text;
+	size_t pos;
+	string error;
+};
+
+enum ArithmeticOperator { NO_OPERATOR, OR, AND, EQUAL, NOT_EQUAL, LESS, LESS_EQUAL, GREATER, GREATER_EQUAL, PLUS, MINUS, TIMES, DIVIDE, MODULO };
+
+int arithmeticPrecedence(ArithmeticOperator op) {
+	static const int precedence[] = { 0, 1, 2, 3, 3, 4, 4, 4, 4, 5, 5, 6, 6, 6 };
+	return precedence[op];
+}
+
+void skipArithmeticSpaces(Arithmetic& arithmetic) {
+	while (arithmetic.pos < arithmetic.text.length() && isspace(arithmetic.text[arithmetic.pos])) {
+		arithmetic.pos++;
+	}
+}
+
+// reads the binary operator at the current position (if any), setting length to its number of characters
+ArithmeticOperator peekArithmeticOperator(Arithmetic& arithmetic, size_t& length) {
+	skipArithmeticSpaces(arithmetic);
+	const string& text = arithmetic.text;
+	char c = arithmetic.pos < text.length() ? text[arithmetic.pos] : '\0';
+	char next = arithmetic.pos + 1 < text.length() ? text[arithmetic.pos + 1] : '\0';
+	length = 2;
+	switch (c) {
+	case '|': return next == '|' ? OR : NO_OPERATOR;
+	case '&': return next == '&' ? AND : NO_OPERATOR;
+	case '=': return next == '=' ? EQUAL : NO_OPERATOR;
+	case '!': return next == '=' ? NOT_EQUAL : NO_OPERATOR;
+	case '<': return next == '=' ? LESS_EQUAL : (length = 1, LESS);
+	case '>': return next == '=' ? GREATER_EQUAL : (length = 1, GREATER);
+	}
+	length = 1;
+	switch (c) {
+	case '+': return PLUS;
+	case '-': return MINUS;
+	case '*': return TIMES;
+	case '/': return DIVIDE;
+	case '%': return MODULO;
+	}
+	return NO_OPERATOR;
+}
+
+long long arithmeticExpression(Arithmetic& arithmetic, int minPrecedence);
+
+// -value, + - and * wrap around in two's complement like in other shells, instead of overflowing
+// (which is undefined behaviour for signed integers)
+long long wrappingNegate(long long value) {
+	return (long long)(0ULL - (unsigned long long)value);
+}
+
+long long wrappingApply(ArithmeticOperator op, long long left, long long right) {
+	unsigned long long a = (unsigned long long)left, b = (unsigned long long)right;
+	switch (op) {
+	case PLUS: return (long long)(a + b);
+	case MINUS: return (long long)(a - b);
+	default: return (long long)(a * b);
+	}
+}
+
+long long arithmeticOperand(Arithmetic& arithmetic) {
+	skipArithmeticSpaces(arithmetic);
+	const string& text = arithmetic.text;
+	size_t start = arithmetic.pos;
+	char c = start < text.length() ? text[start] : '\0';
+	if (c == '(') {
+		arithmetic.pos++;
+		long long value = arithmeticExpression(arithmetic, 1);
+		skipArithmeticSpaces(arithmetic);
+		if (arithmetic.pos >= text.length() || text[arithmetic.pos] != ')') {
+			arithmetic.error = "missing ')'";
+			return 0;
+		}
+		arithmetic.pos++;
+		return value;
+	}
+	if (c == '!' || c == '-' || c == '+') {
+		arithmetic.pos++;
+		long long value = arithmeticOperand(arithmetic);
+		return c == '!' ? !value : c == '-' ? wrappingNegate(value) : value;
+	}
+	if (isdigit(c)) {
+		char* end;
+		long long value = parseNumber(text.c_str() + start, &end, 0);
+		arithmetic.pos = size_t(end - text.c_str());
+		return value;
+	}
+	// a variable, as 'NAME' or '$NAME'
+	if (c == '$') {
+		start++;
+	}
+	size_t end = start;
+	while (end < text.length() && (isalnum(text[end]) || text[end] == '_')) {
+		end++;
+	}
+	if (end == start) {
+		arithmetic.error = "syntax error at '" + text.substr(arithmetic.pos) + "'";
+		return 0;
+	}
+	arithmetic.pos = end;
+	return parseNumber(variableValue(text.substr(start, end - start)).c_str(), nullptr, 0);
+}
+
+// evaluates operands joined by operators of at least minPrecedence
+long long arithmeticExpression(Arithmetic& arithmetic, int minPrecedence) {
+	long long value = arithmeticOperand(arithmetic);
+	size_t length;
+	ArithmeticOperator op;
+	while (arithmetic.error.empty() && (op = peekArithmeticOperator(arithmetic, length)) != NO_OPERATOR
+		&& arithmeticPrecedence(op) >= minPrecedence) {
+		arithmetic.pos += length;
+		// all operators are left associative
+		long long right = arithmeticExpression(arithmetic, arithmeticPrecedence(op) + 1);
+		if ((op == DIVIDE || op == MODULO) && right == 0) {
+			arithmetic.error = "division by zero";
+			return 0;
+		}
+		switch (op) {
+		case OR: value = value || right; break;
+		case AND: value = value && right; break;
+		case EQUAL: value = value == right; break;
+		case NOT_EQUAL: value = value != right; break;
+		case LESS: value = value < right; break;
+		case LESS_EQUAL: value = value <= right; break;
+		case GREATER: value = value > right; break;
+		case GREATER_EQUAL: value = value >= right; break;
+		case PLUS:
+		case MINUS:
+		case TIMES: value = wrappingApply(op, value, right); break;
+		// LLONG_MIN / -1 doesn't fit (and traps with SIGFPE), so divide by -1 as a negation
+		case DIVIDE: value = right == -1 ? wrappingNegate(value) : value / right; break;
+		case MODULO: value = right == -1 ? 0 : value % right; break;
+		case NO_OPERATOR: break;
+		}
+	}
+	return value;
+}
+
+// Evaluates the expression inside $(( )). Prints an error and gives 0 when it is invalid.
+long long evaluateArithmetic(const string& text) {
+	Arithmetic arithmetic = { text, 0, "" };
+	long long value = arithmeticExpression(arithmetic, 1);
+	// anything after the expression is an error
+	while (arithmetic.pos < text.length() && isspace(text[arithmetic.pos])) {
+		arithmetic.pos++;
+	}
+	if (arithmetic.error.empty() && arithmetic.pos < text.length()) {
+		arithmetic.error = "syntax error at '" + text.substr(arithmetic.pos) + "'";
+	}
+	if (!arithmetic.error.empty()) {
+		*session->err << "arithmetic: " << arithmetic.error << " in '" << text << "'" << endl;
+		session->lastExitStatus = 1;
+		return 0;
+	}
+	return value;
+}
+
+string captureOutput(const string& commandLine);
+
+// Expands a single word into zero or more fields:
+// - '$(cmd)' and '`cmd`' are replaced by the output of cmd
+// - '$((expr))' by the value of the arithmetic expression
+// - '$NAME' and '${NAME}' by the variable NAME, '$?' by the exit status of the last expression
+// The expanded text is split on whitespace, so 'x$(echo a b)' gives {"xa", "b"} and '$(true)' nothing at all.
+// The fields are appended to fields.
+void expandWordInto(const string& word, vector<string>& fields) {
+	if (word.find_first_of("$`") == string::npos) {
+		fields.push_back(word);
+		return;
+	}
+
+	string field;
+	bool inField = false;
+	// word splitting of expanded text: whitespace ends the current field
+	auto appendExpanded = [&](const string& text) {
+		for (char c : text) {
+			if (c == ' ' || c == '\t' || c == '\n') {
+				if (inField) {
+					fields.push_back(field);
+					field.clear();
+					inField = false;
+				}
+			}
+			else {
+				field += c;
+				inField = true;
+			}
+		}
+	};
+
+	for (size_t pos = 0; pos < word.length();) {
+		size_t length = substitutionLength(word, pos);
+		if (length >= 5 && word.compare(pos, 3, "$((") == 0 && word.compare(pos + length - 2, 2, "))") == 0) {
+			appendExpanded(to_string(evaluateArithmetic(word.substr(pos + 3, length - 5))));
+			pos += length;
+		}
+		else if (length > 0) {
+			// strip '$(' + ')' or the two backticks
+			size_t open = word[pos] == '`' ? 1 : 2;
+			appendExpanded(captureOutput(word.substr(pos + open, length - open - 1)));
+			pos += length;
+		}
+		else if (word.compare(pos, 2, "${") == 0 && word.find('}', pos) != string::npos) {
+			size_t end = word.find('}', pos);
+			appendExpanded(variableValue(word.substr(pos + 2, end - pos - 2)));
+			pos = end + 1;
+		}
+		else if (word[pos] == '$' && pos + 1 < word.length() && word[pos + 1] == '?') {
+			appendExpanded(to_string(session->lastExitStatus));
+			pos += 2;
+		}
+		else if (word[pos] == '$' && pos + 1 < word.length() && (isalpha(word[pos + 1]) || word[pos + 1] == '_')) {
+			size_t end = pos + 1;
+			while (end < word.length() && (isalnum(word[end]) || word[end] == '_')) {
+				end++;
+			}
+			appendExpanded(variableValue(word.substr(pos + 1, end - pos - 1)));
+			pos = end;
+		}
+		else {
+			field += word[pos++];
+			inField = true;
+		}
+	}
+	if (inField) {
+		fields.push_back(field);
+	}
+}
+
+vector<string> expandWord(const string& word) {
+	vector<string> fields;
+	expandWordInto(word, fields);
+	return fields;
+}
+
+// Expands the words of all commands and the redirection file names.
+// Returns false when a file name does not expand to exactly one word.
+bool expandExpression(Expression& expression) {
+	for (auto& command : expression.commands) {
+		vector<string> parts;
+		parts.reserve(command.parts.size());
+		for (const auto& part : command.parts) {
+			expandWordInto(part, parts);
+		}
+		command.parts.swap(parts);
+	}
+	for (string* file : { &expression.inputFromFile, &expression.outputToFile }) {
+		if (file->empty()) {
+			continue;
+		}
+		vector<string> fields = expandWord(*file);
+		if (fields.size() != 1) {
+			*session->err << "ambiguous redirect: " << *file << endl;
+			return false;
 		}
+		*file = fields[0];
 	}
-	cout << "\e[" << SEPCOLOR << "m Ω " << "\e[" << OMEGACOLOR << "m";
+	return true;
 }
 
-void displayStandardPrompt(char* dir) {
-	if (dir) {
-		cout << "\e[32m" << dir << "\e[39m";
+// true for a 'head' that reads its stdin and exits after some lines: 'head', 'head -n N', 'head -nN' or 'head -N'
+bool isHeadOfStdin(const Command& command) {
+	const vector<string>& parts = command.parts;
+	if (parts.empty() || parts[0] != "head") {
+		return false;
 	}
-	cout << "$ ";
+	for (size_t i = 1; i < parts.size(); ++i) {
+		const string& arg = parts[i];
+		if (arg == "-n" && i + 1 < parts.size() && isdigit(parts[i + 1][0])) {
+			i++;
+		}
+		else if (!(arg.size() > 1 && arg[0] == '-' && (isdigit(arg[1]) || (arg[1] == 'n' && arg.size() > 2 && isdigit(arg[2]))))) {
+			return false;
+		}
+	}
+	return true;
 }
 
-// shows a user prompt in the terminal showing the current working dir and a $
-void displayPrompt() {
-	char buffer[512];
-	char* dir = getcwd(buffer, sizeof(buffer));
-
-#if SHELLTHEME == 1
-	displayCustomPrompt(dir);
-#else 
-	displayStandardPrompt(dir);
-#endif
-
-	flush(cout);
+// Whether stopping command early can't make a difference besides the output it no longer writes:
+// builtins and a few producers that don't touch anything else.
+bool isSideEffectFree(const Command& command) {
+	static const char* const PRODUCERS[] = { "cat", "yes", "seq", "sleep" };
+	if (command.parts.empty()) {
+		return false;
+	}
+	if (findBuiltin(command.parts[0]) != nullptr) {
+		return true;
+	}
+	for (const char* producer : PRODUCERS) {
+		if (command.parts[0] == producer) {
+			return true;
+		}
+	}
+	return false;
 }
 
-// gets the current input from the commandline
-// (and shows prompt if showPrompt==True)
-string requestCommandLine(bool showPrompt) {
-	if (showPrompt) {
-		displayPrompt();
-	}
-	string retval;
-	getline(cin, retval);
-	return retval;
+// whether the shell can open path (relative to the session) as a regular file for reading
+bool isReadableFile(const string& path) {
+	struct stat st;
+	string file = sessionPath(path);
+	return stat(file.c_str(), &st) == 0 && S_ISREG(st.st_mode) && access(file.c_str(), R_OK) == 0;
 }
 
-// note: For such a simple shell, there is little need for a full blown parser (as in an LL or LR capable parser).
-// Here, the user input can be parsed using the following approach.
-// First, divide the input into the distinct commands (as they can be chained, separated by `|`).
-// Next, these commands are parsed separately. The first command is checked for the `<` operator, and the last command for the `>` operator.
-Expression parseCommandLine(string commandLine) {
-	Expression expression;
-	vector<string> commands = splitString(commandLine, '|');
-	for (size_t i = 0; i < commands.size(); ++i) {
-		string& line = commands[i];
-		vector<string> args = splitString(line, ' ');
-		if (i == commands.size() - 1 && args.size() > 1 && args[args.size() - 1] == "&") {
-			expression.background = true;
-			args.resize(args.size() - 1);
+// Rewrites an (expanded) expression into a cheaper one that behaves the same:
+// - a 'cat' between two stages is dropped: 'a | cat | cat | b' becomes 'a | b'
+// - a leading 'cat FILE |' or 'cat < FILE |' becomes a redirection: 'cat FILE | b' becomes 'b < FILE'
+//   (only for a readable regular file, otherwise cat has to report the error)
+// - builtin stages (like 'echo') of a pipeline run in their forked child without exec'ing,
+//   when the builtin handles their arguments (see Builtin)
+// - when a 'head' stage is satisfied and exits, the stages before it are stopped right away,
+//   provided they are all side-effect free (see isSideEffectFree), so only their output is lost
+// A trailing 'cat' stays, as 'ls | cat' behaves differently from 'ls' on a terminal.
+// A description of every rewrite is appended to notes (when given).
+void optimizeExpression(Expression& expression, vector<string>* notes = nullptr) {
+	vector<Command>& commands = expression.commands;
+	auto note = [&](const string& text) {
+		if (notes != nullptr) {
+			notes->push_back(text);
 		}
-		if (i == commands.size() - 1 && args.size() > 2 && args[args.size() - 2] == ">") {
-			expression.outputToFile = args[args.size() - 1];
-			args.resize(args.size() - 2);
+	};
+	auto isPlainCat = [](const Command& command, size_t size) {
+		return command.parts.size() == size && command.parts[0] == "cat" && command.timeoutMs == 0;
+	};
+
+	for (size_t i = 1; i + 1 < commands.size();) {
+		if (isPlainCat(commands[i], 1)) {
+			note("dropped the 'cat' in the middle of the pipeline");
+			commands.erase(commands.begin() + long(i));
 		}
-		if (i == 0 && args.size() > 2 && args[args.size() - 2] == "<") {
-			expression.inputFromFile = args[args.size() - 1];
-			args.resize(args.size() - 2);
+		else {
+			i++;
 		}
-		expression.commands.push_back({ args });
 	}
-	return expression;
-}
 
+	if (commands.size() > 1 && expression.inputFromFile.empty() && isPlainCat(commands[0], 2)
+		&& commands[0].parts[1][0] != '-' && isReadableFile(commands[0].parts[1])) {
+		expression.inputFromFile = commands[0].parts[1];
+		note("'cat " + expression.inputFromFile + " |' became '< " + expression.inputFromFile + "'");
+		commands.erase(commands.begin());
+	}
+	else if (commands.size() > 1 && !expression.inputFromFile.empty() && isPlainCat(commands[0], 1)) {
+		note("'cat < " + expression.inputFromFile + " |' became '< " + expression.inputFromFile + "'");
+		commands.erase(commands.begin());
+	}
 
-// Change current directory to the users $HOME directory
-int goHome() {
-	char* home_dir;
-
-	home_dir = getenv("HOME");
-	if (home_dir != NULL) {
-		if( chdir(home_dir) < 0){
-			cerr << "Error when changing to home directory" <<endl;
-			cerr << strerror(errno) << endl;
+	// a single builtin without redirections runs inside the shell already (see builtinFor)
+	bool forked = commands.size() > 1 || !expression.inputFromFile.empty() || !expression.outputToFile.empty() || expression.background;
+	bool upstreamSideEffectFree = true;
+	for (size_t i = 0; i < commands.size(); ++i) {
+		Builtin builtin = forked && !commands[i].parts.empty() ? findBuiltin(commands[i].parts[0]) : nullptr;
+		// builtins only produce output, so trying one out makes no difference
+		string output;
+		if (builtin != nullptr && builtin(commands[i].parts, output) != BUILTIN_DECLINED) {
+			commands[i].runAsBuiltin = true;
+			note("'" + commands[i].parts[0] + "' runs as builtin in its child, without exec");
 		}
-		return CHANGED_DIR_FLAG;
-	}
-	else {
-		cerr << "no $HOME directory found" << endl;
-		return -1;
+		if (i > 0 && isHeadOfStdin(commands[i]) && upstreamSideEffectFree) {
+			commands[i].stopsUpstream = true;
+			note("the stages before '" + describeExpression({ { commands[i] } }) + "' stop when it exits");
+		}
+		upstreamSideEffectFree = upstreamSideEffectFree && isSideEffectFree(commands[i]);
 	}
 }
 
-// Handle a 'cd' command, only handles a single viable path.
-int handleChangeDirectory(Command cmd) {
-	// only cd, we chdir to $HOME.
-	if (cmd.parts.size() == 1) {
-		return goHome();
+// Handle an 'explain CMD...' command: print the rest of the expression before and after
+// optimizing it (see optimizeExpression), without running it.
+int handleExplain(Expression expression) {
+	vector<string>& parts = expression.commands[0].parts;
+	parts.erase(parts.begin());
+	if (parts.empty()) {
+		*session->err << "Usage: explain COMMAND..." << endl;
+		return BUILTIN_FLAG;
 	}
-	// we won't handle multiple arguments. Just a single directory.
-	else if (cmd.parts.size() != 2) {
-		cerr << "Wrong amount of arguments for cd " << endl;
-		cerr << "Usage: cd <path>" << endl;
-		return CHANGED_DIR_FLAG;
+	*session->out << "original:  " << describeExpression(expression) << endl;
+	vector<string> notes;
+	if (session->optimizing) {
+		optimizeExpression(expression, &notes);
 	}
-	// ~ indicates user $HOME directory, for this shell. So go home.
-	else if (cmd.parts.at(1).compare("~") == 0) {
-		return goHome();
+	else {
+		notes.push_back("optimize is off");
 	}
-	// last case, try to go to the specified directory.
-	else if ((chdir(cmd.parts.at(1).c_str())) < 0) {
-		cerr << "cd error:" << endl;
-		cerr << strerror(errno) << endl;
+	*session->out << "optimized: " << describeExpression(expression) << endl;
+	for (const auto& note : notes) {
+		*session->out << "- " << note << endl;
 	}
-	return CHANGED_DIR_FLAG;
+	return BUILTIN_FLAG;
 }
 
-
-// Handle exit and chande dir.
-int handleInternalCommands(Expression& expression) {
-	for (const auto& command : expression.commands) {
-		for (const auto& part : command.parts) {
-			if (part.compare("exit") == 0) {
-				cout << "Bye!" << endl;
-				flush(cout);
-				exit(0);
-			}
-		}
-		if (command.parts[0].compare("cd") == 0) {
-			return handleChangeDirectory(command);
-		}
+// Returns the builtin (see findBuiltin) when expression is a single command that can run inside the shell,
+// or nullptr when it has to run as processes.
+Builtin builtinFor(const Expression& expression) {
+	const vector<string>& parts = expression.commands[0].parts;
+	if (expression.commands.size() != 1 || parts.empty() || expression.background || !expression.inputFromFile.empty()
+		|| !expression.outputToFile.empty() || expression.commands[0].timeoutMs != 0) {
+		return nullptr;
 	}
-	return 0;
+	return findBuiltin(parts[0]);
 }
 
+// Runs builtin inside the shell, without forking. Its output goes to capture or else to stdout.
+// Returns false when it declined args, the command has to run as a process then.
+bool runBuiltin(Builtin builtin, const vector<string>& args, string* capture) {
+	string output;
+	int status = builtin(args, capture != nullptr ? *capture : output);
+	if (status == BUILTIN_DECLINED) {
+		return false;
+	}
+	session->lastExitStatus = status;
+	if (!output.empty()) {
+		*session->out << output;
+		flush(*session->out);
+	}
+	return true;
+}
 
-// Execute an expression
-// - check for inputfile, get/set corresponding input filedescriptor
-// - create pipes to connect child processes from fork()
-// - get outputfile file descriptors (in overwrite mode!) when needed
-// - execute commands with execvp in a child process
-// - wait for child process pids at the end if this is not a background expression.
-int executeCommands(Expression& expression) {
-	int AMT_COMMANDS = expression.commands.size();
-	int LAST = AMT_COMMANDS - 1;
-
-	int pipefd[2];
-	int inputfd, outputfd;
-
-	int FileInputModeFlag = O_RDONLY;
-	int FileOutputModeFlag = O_WRONLY | O_CREAT | O_EXCL | O_TRUNC;
+int executeExpandedExpression(Expression& expression, string* capture);
 
-	mode_t writePermissions = 0644;
+// Executes an expression: expands its words, handles internal commands, then runs it.
+// With capture, the output is appended there instead (for command substitution, which runs in
+// a subshell, so internal commands like 'cd' don't change the state of the shell, see captureOutput).
+// The exit status ends up in lastExitStatus.
+int executeExpression(Expression& expression, string* capture = nullptr) {
+	// Check for empty expression
+	if (expression.commands.size() == 0) {
+		*session->err << "No input command was given" << endl;
+		return EINVAL;
+	}
 
-	pid_t cpid;
-	pid_t cpids[AMT_COMMANDS];
+	if (!expandExpression(expression)) {
+		session->lastExitStatus = 1;
+		return 0;
+	}
+	return executeExpandedExpression(expression, capture);
+}
 
-	// If an input file is given, create a filedescriptor and set it as input
-	if (expression.inputFromFile.empty() == 0) {
-		if ((inputfd = open(expression.inputFromFile.c_str(), FileInputModeFlag)) < 0) {
-			// handle errors
-			cerr << "fail when opening filedescriptor for " << expression.inputFromFile.c_str() << endl;
-			cerr << strerror(errno) << endl;
-			return -1;
-		}
-		DEBUGs("Created inputfd " << inputfd << " for " << expression.inputFromFile.c_str());
+// executeExpression, for an expression that has its words expanded already
+int executeExpandedExpression(Expression& expression, string* capture) {
+	// // Handle internal commands (like 'cd' and 'exit')
+	int status;
+	if (capture == nullptr) {
+		status = handleInternalCommands(expression);
 	}
-	// Otherwise, we set the first inputfd to 0
 	else {
-		inputfd = STDIN_FILENO;
+		// what they print is output of the substitution
+		ostringstream output;
+		ostream* out = session->out;
+		session->out = &output;
+		status = handleInternalCommands(expression);
+		session->out = out;
+		*capture += output.str();
+	}
+	if (status == CHANGED_DIR_FLAG || status == BUILTIN_FLAG) {
+		session->lastExitStatus = 0;
+		return 0; // cd or another internal command happened
 	}
 
-	for (int i = 0; i < AMT_COMMANDS; i++) {
-		if (i != LAST) {
-			// if there are more processes to be started, 
-			// we create a pipe to redirect their I/Os
-			if (pipe(pipefd) != 0) {
-				cerr << "Failed to create pipe!\n";
-				cerr << strerror(errno) << endl;
-				abort();
-			}
-		}
+	if (session->optimizing) {
+		optimizeExpression(expression);
+	}
 
-		// create child process. 
-		if ((cpid = fork()) < 0) {
-			cerr << strerror(cpid) << "\nfork failed" << endl;
-			cerr << strerror(errno) << endl;
-			abort();
-		}
+	Builtin builtin = builtinFor(expression);
+	if (builtin != nullptr && runBuiltin(builtin, expression.commands[0].parts, capture)) {
+		return 0;
+	}
 
+	if (expression.deadlineMs == 0) {
+		expression.deadlineMs = session->defaultDeadlineMs;
+	}
+	if (capture != nullptr) {
+		// the shell has to wait for the output anyway
+		expression.background = false;
+	}
 
-		if (cpid == 0) {
-			// child part of loop 
-			DEBUG("cpid " << getpid() << " started with input: " << inputfd);
-			if (inputfd != STDIN_FILENO) {
-				// replace stdin of child process with the output from previous pipe
-				// or in case of an inputfile, set that as the stdin.
-				if (dup2(inputfd, STDIN_FILENO) < 0) {
-					cerr << "dup2(inputfd, STDIN) failed: (inputfd :" << inputfd << ")" << endl;
-					cerr << strerror(errno) << endl;
-					abort();
-				}
-				// clear resources
-				if (close(inputfd) < 0) {
-					cerr << "fail when closing inputfd : " << inputfd << endl;
-					cerr << strerror(errno) << endl;
-					abort();
-				}
-			}
+	int rc = executeCommands(expression, capture);
+	if (rc != 0) {
+		*session->err << "executeCommands failed!" << endl;
+		*session->err << strerror(rc) << endl;
+		*session->err << strerror(errno) << endl;
+		session->lastExitStatus = 1;
+	}
+	return 0;
 
-			if (i != LAST) {
-				// (skips last child)
-				// child processes should redirect their stdout
-				// to the input end of the next pipe
-				if (dup2(pipefd[1], STDOUT_FILENO) < 0) {
-					cerr << "dup2(fd[1], STDOUT) failed: (fd[1] :" << inputfd << ")" << endl;
-					cerr << strerror(errno) << endl;
-					abort();
-				}
-				if (close(pipefd[1]) < 0) {
-					cerr << "fail when closing pipefd[1]: " << pipefd[1] << endl;
-					cerr << strerror(errno) << endl;
-					abort();
-				}
+}
+
+// Executes a parsed command line and returns its exit status (also left in lastExitStatus).
+// Nothing is re-parsed, a loop body only has its words expanded again on every iteration.
+int executeNode(const Node& node, string* capture = nullptr) {
+	// nothing runs after 'exit' in an embedded session
+	if (session->exitRequested) {
+		return session->lastExitStatus;
+	}
+	int status = 0;
+	switch (node.kind) {
+	case Node::PIPELINE: {
+		// a lone builtin (like the '[' of a loop condition) doesn't need a copy of the expression to expand
+		Builtin builtin = builtinFor(node.expression);
+		if (builtin != nullptr) {
+			vector<string> args;
+			args.reserve(node.expression.commands[0].parts.size());
+			for (const auto& part : node.expression.commands[0].parts) {
+				expandWordInto(part, args);
 			}
-			// if an outputfile is given
-			else if (i == LAST && (expression.outputToFile.empty() == 0)) {
-				// open a fd for the output file in write or read/write mode
-				// not sure if its the right option to do this here, instead of
-				// above the whole for-loop
-				// O_WRONLY | O_TRUNC | O_CREAT | O_EXCL
-				if ((outputfd = open(expression.outputToFile.c_str(), FileOutputModeFlag, writePermissions)) < 0) {
-					cerr << "opening file error for " << expression.outputToFile.c_str() << endl;
-					cerr << strerror(errno) << endl; // errorcode should be better described with this!
-					abort();
-				}
-				DEBUGs("Created outputfd: " << outputfd);
-				if (dup2(outputfd, STDOUT_FILENO) < 0) {
-					cerr << "dup2(outputfd, STDOUT) failed: (outputfd :" << outputfd << ")" << endl;
-					cerr << strerror(errno) << endl;
-					abort();
-				}
-				if (close(outputfd) < 0) {
-					cerr << "fail when closing outputfd: " << outputfd << endl;
-					cerr << strerror(errno) << endl;
-					abort();
-				}
+			if (runBuiltin(builtin, args, capture)) {
+				return session->lastExitStatus;
 			}
-
-			// Execute the commands! This uses the c++ wrapper for execvp
-			// we expect the child not to return from this, as the process
-			// should be replaced by execvp.
-			int errcode = executeCommand(expression.commands[i]);
-			if (errcode != 0) {
-				cerr << "Process (pid: " << getpid() << ") encountered a bad command: ";
-				for (auto part : expression.commands[i].parts) {
-					cerr << part << " ";
-				}
-				cerr << endl;
-				cerr << strerror(errno) << endl;
+			// declined: it runs as a process, with the words expanded already (a '$(...)' runs once)
+			Expression expression = node.expression;
+			expression.commands[0].parts.swap(args);
+			if (executeExpandedExpression(expression, capture) != 0) {
+				session->lastExitStatus = 1;
 			}
-			abort();
+			return session->lastExitStatus;
 		}
-		// parent part of the loop
-		else {
-
-			// make the new input the output of the pipe we have
-			if (i != LAST) {
-				inputfd = pipefd[0];
-
-				// close the write end of this pipe
-				if (close(pipefd[1]) < 0) {
-					cerr << i << " fail when closing fd in parent: " << pipefd[1] << endl;
-					cerr << strerror(errno) << endl;
-					abort();
-				}
-			}
-
-			// administration
-			// question: should/could be skipped if exp.background=true?
-			cpids[i] = cpid;
+		Expression expression = node.expression;
+		if (executeExpression(expression, capture) != 0) {
+			session->lastExitStatus = 1;
 		}
+		return session->lastExitStatus;
 	}
-
-	// wait for children to finish their processing
-	// (skips if expression.background=true)
-	if (!expression.background) {
-		for (auto cpid : cpids) {
-			DEBUG("waiting for pid: " << cpid);
-			if (cpid != 0) {
-				// when to use WNOHANG instead of NULL?
-				if (waitpid(cpid, NULL, 0) < 0 ){
-					cerr << "waitpid error for "<< cpid << endl;
-					cerr << strerror(errno);
+	case Node::ASSIGNMENT:
+		for (const auto& word : node.words) {
+			size_t equals = word.find('=');
+			// the value is not split into words, 'a=$(ls)' keeps everything
+			vector<string> fields = expandWord(word.substr(equals + 1));
+			string& value = session->variables[word.substr(0, equals)];
+			value.clear();
+			for (const auto& field : fields) {
+				if (!value.empty()) {
+					value += ' ';
 				}
+				value += field;
 			}
-			else {
-				cerr << "Encountered pid = 0 error" << endl;
-				return 1;
+		}
+		break;
+	case Node::SEQUENCE:
+		for (const auto& child : node.children) {
+			status = executeNode(child, capture);
+		}
+		break;
+	case Node::AND:
+	case Node::OR:
+		status = executeNode(node.children[0], capture);
+		if ((status == 0) == (node.kind == Node::AND)) {
+			status = executeNode(node.children[1], capture);
+		}
+		break;
+	case Node::IF:
+		for (size_t i = 0; i + 1 < node.children.size(); i += 2) {
+			if (executeNode(node.children[i], capture) == 0) {
+				return executeNode(node.children[i + 1], capture);
 			}
 		}
-		DEBUG("waited for all pid, returning");
+		if (node.children.size() % 2 == 1) {
+			return executeNode(node.children.back(), capture);
+		}
+		break;
+	case Node::WHILE:
+	case Node::UNTIL:
+		while ((executeNode(node.children[0], capture) == 0) == (node.kind == Node::WHILE) && !session->exitRequested) {
+			status = executeNode(node.children[1], capture);
+		}
+		break;
+	case Node::FOR:
+		for (const auto& word : node.words) {
+			for (const auto& value : expandWord(word)) {
+				session->variables[node.variable] = value;
+				status = executeNode(node.children[0], capture);
+			}
+		}
+		break;
 	}
-
-	return 0;
+	session->lastExitStatus = status;
+	return status;
 }
 
-int executeExpression(Expression& expression) {
-	// Check for empty expression
-	if (expression.commands.size() == 0) {
-		cerr << "No input command was given" << endl;
-		return EINVAL;
+// Parses and executes a command line, returns its exit status. See executeExpression for capture.
+int executeCommandLine(const string& commandLine, string* capture = nullptr) {
+	Parser parser;
+	Node script = parseScript(commandLine, parser);
+	if (!parser.error.empty()) {
+		*session->err << parser.error << endl;
+		session->lastExitStatus = 2;
+		return session->lastExitStatus;
 	}
+	return executeNode(script, capture);
+}
 
-	// // Handle internal commands (like 'cd' and 'exit')
-	int status = handleInternalCommands(expression);
-	if (status == CHANGED_DIR_FLAG) {
-		return 0; // cd happened
-	}
+// Runs commandLine for a command substitution and returns its output without the trailing newlines.
+// A single builtin (like 'pwd' or 'echo $HOME') is evaluated by the shell itself without forking,
+// anything else runs as a pipeline whose output is read back through a pipe.
+// Like in other shells it runs in a subshell: a copy of the session, so what it changes (its directory,
+// variables, 'deadline', or an 'exit') stays there. Only its exit status and the metrics come back.
+string captureOutput(const string& commandLine) {
+	Session subshell;
+	subshell.subshell = true;
+	subshell.defaultDeadlineMs = session->defaultDeadlineMs;
+	subshell.lastExitStatus = session->lastExitStatus;
+	subshell.variables = session->variables;
+	subshell.metrics = session->metrics;
+	subshell.optimizing = session->optimizing;
+	subshell.jobLogging = session->jobLogging;
+	subshell.out = session->out;
+	subshell.err = session->err;
+	subshell.embedded = session->embedded;
+	subshell.cwd = session->cwd;
+	subshell.stageResults = session->stageResults;
+
+	Session* parent = session;
+	session = &subshell;
+	string output;
+	executeCommandLine(commandLine, &output);
+	session = parent;
+	session->lastExitStatus = subshell.lastExitStatus;
+	session->metrics = subshell.metrics;
+	size_t end = output.find_last_not_of('\n');
+	output.resize(end == string::npos ? 0 : end + 1);
+	return output;
+}
 
-	int rc = executeCommands(expression);
-	if (rc != 0) {
-		cerr << "executeCommands failed!" << endl;
-		cerr << strerror(rc) << endl;
-		cerr << strerror(errno) << endl;
+// gets the next line of a command that continues over several lines, like a 'while' loop
+// (and shows a '> ' prompt if showPrompt==True)
+string requestContinuationLine(bool showPrompt) {
+	if (showPrompt) {
+		cout << "> ";
+		flush(cout);
 	}
-	return 0;
-
+	waitForInput();
+	string retval;
+	getline(cin, retval);
+	return retval;
 }
 
 int normal(bool showPrompt) {
 	while (cin.good()) {
 		string commandLine = requestCommandLine(showPrompt);
-		Expression expression = parseCommandLine(commandLine);
-		int rc = executeExpression(expression);
+		Parser parser;
+		Node script = parseScript(commandLine, parser);
+		while (parser.incomplete && cin.good()) {
+			commandLine += "\n" + requestContinuationLine(showPrompt);
+			script = parseScript(commandLine, parser);
+		}
+
+		int rc = 0;
+		if (!parser.error.empty()) {
+			cerr << parser.error << endl;
+			session->lastExitStatus = 2;
+		}
+		else if (script.children.empty()) {
+			// reports that no command was given
+			Expression expression;
+			rc = executeExpression(expression);
+		}
+		else {
+			executeNode(script);
+		}
+		// reap finished background jobs
+		updateJobs();
 
 		if (rc != 0) {
 			cerr << "mainloop received error:\n";
@@ -467,6 +2969,151 @@ int normal(bool showPrompt) {
 	return 0;
 }
 
+// Runs run() with state as the session of this thread (see session), and collects
+// everything it writes and the exit statuses of its stages into a ShellResult.
+template <typename Run>
+ShellResult runInSession(Session& state, Run run) {
+	Session* previous = session;
+	session = &state;
+	ShellResult result;
+	ostringstream out, err;
+	state.out = &out;
+	state.err = &err;
+	state.stageResults = &result.stages;
+	state.exitRequested = false;
+
+	run();
+	updateJobs();
+
+	result.status = state.lastExitStatus;
+	result.exited = state.exitRequested;
+	result.out = out.str();
+	result.err = err.str();
+	state.out = &cout;
+	state.err = &cerr;
+	state.stageResults = nullptr;
+	session = previous;
+	return result;
+}
+
+Shell::Shell() : state(new Session()) {
+	char buffer[MAXPATHLEN];
+	state->embedded = true;
+	state->cwd = getcwd(buffer, sizeof(buffer)) != NULL ? buffer : "/";
+}
+
+Shell::~Shell() {
+	for (auto& entry : state->pipelines) {
+		AsyncPipeline& pipeline = entry.second;
+		signalPipeline(pipeline.stages, pipeline.pgid, SIGKILL);
+		for (auto& stage : pipeline.stages) {
+			closeFd(stage.pidfd);
+			closeFd(stage.timerfd);
+			if (!stage.done) {
+				waitpid(stage.pid, &stage.status, 0);
+			}
+		}
+		closeFd(pipeline.capturefd);
+		closeFd(pipeline.errorfd);
+		closeFd(pipeline.deadlinefd);
+	}
+	closeFd(state->epollfd);
+	for (auto& job : state->jobs) {
+		for (auto& stage : job.stages) {
+			if (!stage.done) {
+				signalStage(stage, SIGKILL);
+				waitpid(stage.pid, &stage.status, 0);
+			}
+		}
+		closeFd(job.logfd);
+		closeJobLog(job.log);
+	}
+}
+
+ShellResult Shell::run(const string& commandLine) {
+	return runInSession(*state, [&]() {
+		executeCommandLine(commandLine);
+	});
+}
+
+ShellResult Shell::run(const Expression& expression) {
+	return runInSession(*state, [&]() {
+		Expression copy = expression;
+		if (executeExpression(copy) != 0) {
+			session->lastExitStatus = 1;
+		}
+	});
+}
+
+void Shell::submit(const Expression& expression, ShellCompletion done) {
+	ShellResult result = runInSession(*state, [&]() {
+		Expression copy = expression;
+		copy.background = false;
+		session->submitted = &done;
+		if (executeExpression(copy) != 0) {
+			session->lastExitStatus = 1;
+		}
+	});
+	if (state->submitted != nullptr) {
+		// it ran without starting processes (a builtin, or it failed): complete it with the next poll()
+		state->submitted = nullptr;
+		state->finished.emplace_back(move(done), move(result));
+		return;
+	}
+	// messages of the shell itself (from expanding the words, say) come before the output of the stages
+	auto found = state->pipelines.find(state->nextPipelineId - 1);
+	ShellResult& submitted = found != state->pipelines.end() ? found->second.result : state->finished.back().second;
+	submitted.out.insert(0, result.out);
+	submitted.err.insert(0, result.err);
+}
+
+size_t Shell::poll(int timeoutMs) {
+	vector<pair<ShellCompletion, ShellResult>> completions;
+	completions.swap(state->finished);
+	bool jobLogs = false;
+	for (const auto& job : state->jobs) {
+		jobLogs = jobLogs || job.logfd >= 0;
+	}
+	if (!state->pipelines.empty() || jobLogs) {
+		Session* previous = session;
+		session = state.get();
+		struct epoll_event events[256];
+		// the output of jobs is only drained, nobody waits for it
+		bool wait = completions.empty() && !state->pipelines.empty();
+		int count = epoll_wait(state->epollfd, events, 256, wait ? timeoutMs : 0);
+		for (int i = 0; i < count; i++) {
+			handlePipelineEvent(events[i].data.u64, completions);
+		}
+		session = previous;
+	}
+	// the completions may submit new expressions, so they run last
+	for (auto& completion : completions) {
+		completion.first(completion.second);
+	}
+	return pending();
+}
+
+size_t Shell::pending() const {
+	return state->pipelines.size() + state->finished.size();
+}
+
+string Shell::directory() const {
+	return state->cwd;
+}
+
+string Shell::variable(const string& name) const {
+	auto found = state->variables.find(name);
+	if (found != state->variables.end()) {
+		return found->second;
+	}
+	const char* value = getenv(name.c_str());
+	return value != NULL ? value : "";
+}
+
+void Shell::setVariable(const string& name, const string& value) {
+	state->variables[name] = value;
+}
+
 // unused commands below.
 
 // deprecated
@@ -653,10 +3300,29 @@ int demoThreeCommandsOnePipe(bool showPrompt) {
 }
 
 int shell(bool showPrompt) {
+	Session interactive;
+	session = &interactive;
+	// the lean path (see shellCommand), which also gives cin a buffer that waitForInput can look into
+	ios_base::sync_with_stdio(false);
 	// main shell loop
 	return normal(showPrompt);
 
 	/// available demo's
 	/// return demoTwoCommands(showPrompt);
 	/// return demoThreeCommandsOnePipe(showPrompt);
-}
\ No newline at end of file
+}
+
+// Runs one command line (shell -c CMD) and returns its exit status, without the interactive loop.
+// This is the lean startup path: iostreams aren't synchronized with stdio (the shell flushes before
+// it forks), and everything else a session may need, like the jump index or the epoll instance,
+// is only set up once a command uses it.
+int shellCommand(const char* commandLine) {
+	ios_base::sync_with_stdio(false);
+	Session command;
+	session = &command;
+	executeCommandLine(commandLine);
+	// background jobs keep running, but the finished ones are reported
+	updateJobs();
+	flush(cout);
+	return command.lastExitStatus;
+}
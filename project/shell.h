@@ -0,0 +1,163 @@
+#pragma once
+
+// Library interface of the shell, to run command lines from another program without starting
+// the shell binary:
+//
+// Shell shell;
+// ShellResult result = shell.run("cd /tmp; ls | wc -l");
+// // result.out == "42\n", result.status == 0, result.stages[1].usage.ru_maxrss == ...
+//
+// Every Shell is a session of its own, with its own variables, directory, deadline and jobs,
+// so a program can keep as many of them as it likes. Running one is not thread safe, but
+// different sessions can run on different threads.
+//
+// Pipelines can also run asynchronously, thousands at a time from one thread, driven by poll():
+//
+// shell.submit(parseCommandLine("curl -s $URL | wc -c"), [](ShellResult& result) { ... });
+// while (shell.poll() > 0) {
+// }
+//
+// With C++20 coroutines, 'ShellResult result = co_await shell.submit(expression);' does the same.
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+#include <sys/resource.h>
+
+// Command structure holds command and arguments
+// e.g. with input  'tail -c 10', parts will be {"tail", "-c" , "10"}
+// timeoutMs is set by a 'timeout DURATION' prefix, 0 means this stage has no deadline
+// runAsBuiltin and stopsUpstream are set by the optimizer (see optimizeExpression)
+struct Command
+{
+	std::vector<std::string> parts = {};
+	long timeoutMs = 0;
+	bool runAsBuiltin = false;
+	bool stopsUpstream = false;
+};
+
+// Experssion structure holds:
+// - names of input/output files
+// - whether the expression should be executed in the background
+// - deadline for the whole expression in ms (0 = none), taken from the shell-wide default
+// - vector of all commands
+//   e.g if input is 'ls -l | head', commands will be {Command, Command};
+//   (expands to) {{"ls", "-l"}, {"head"}}
+struct Expression
+{
+	std::vector<Command> commands;
+	std::string inputFromFile;
+	std::string outputToFile;
+	bool background = false;
+	long deadlineMs = 0;
+};
+
+// Parses a command line holding a single pipeline into an expression, or gives an empty one
+// and describes what is wrong with it in error (when given).
+Expression parseCommandLine(const std::string& commandLine, std::string* error = nullptr);
+
+// A pipeline stage that ran as a process
+struct StageResult
+{
+	std::vector<std::string> command; // the expanded words of the stage
+	int status = 0; // exit status: 128 + signal number when killed, 124 when it ran past its deadline
+	struct rusage usage = {}; // resources used by the process
+};
+
+struct ShellResult
+{
+	int status = 0; // exit status of the command line, like '$?'
+	bool exited = false; // the command line ran 'exit', what came after it did not run
+	std::string out; // everything written to stdout: by the stages, builtins and the shell itself
+	std::string err; // the same for stderr
+	// the stages that ran as a process, pipeline after pipeline. Builtins evaluated
+	// by the shell itself (like 'echo' on its own) and background jobs are not in here.
+	std::vector<StageResult> stages;
+};
+
+// called with the result of a submitted expression, see Shell::submit()
+typedef std::function<void(ShellResult& result)> ShellCompletion;
+
+#if defined(__cpp_impl_coroutine) && defined(__has_include)
+#if __has_include(<coroutine>)
+#include <coroutine>
+#define SHELL_COROUTINES 1
+#endif
+#endif
+
+#if SHELL_COROUTINES
+class Shell;
+
+// co_await'ing this submits the expression and resumes with its result, from Shell::poll()
+struct ShellAwaitable
+{
+	Shell* shell;
+	Expression expression;
+	ShellResult result = {};
+
+	bool await_ready() const {
+		return false;
+	}
+	void await_suspend(std::coroutine_handle<> handle);
+	ShellResult await_resume() {
+		return std::move(result);
+	}
+};
+#endif
+
+struct Session;
+
+class Shell
+{
+public:
+	// a new session in the current directory of the process
+	Shell();
+	// background jobs and submitted expressions that are still running are killed
+	~Shell();
+	Shell(const Shell&) = delete;
+	Shell& operator=(const Shell&) = delete;
+
+	// Runs a command line, which may be anything typed at the prompt (including several lines).
+	// The stages read nothing: their stdin is /dev/null unless redirected.
+	ShellResult run(const std::string& commandLine);
+	// Runs an expression, e.g. from parseCommandLine()
+	ShellResult run(const Expression& expression);
+
+	// Starts an expression without waiting for it (it never becomes a background job).
+	// done(result) is called from poll() once all its stages have exited and their output is read.
+	// Expanding its words (and running what they substitute) happens right away, and so do builtins.
+	void submit(const Expression& expression, ShellCompletion done);
+#if SHELL_COROUTINES
+	ShellAwaitable submit(const Expression& expression) {
+		return ShellAwaitable { this, expression };
+	}
+#endif
+	// Waits up to timeoutMs (-1: until something happens) for the submitted expressions and calls
+	// the completions of the ones that finished. Returns the number that has not completed yet.
+	// The stages of all submitted expressions are watched with one epoll instance, over their pidfds
+	// and pipes, so no threads are involved and nothing blocks in waitpid().
+	// The output of background jobs ('cmd &') is drained here too (without waiting for it), and during
+	// run(): a job whose output fills its pipe in between pauses until one of them is called.
+	size_t poll(int timeoutMs = -1);
+	// the number of submitted expressions that have not completed yet
+	size_t pending() const;
+
+	// the session's current directory, changed by 'cd' (the directory of the process stays the same)
+	std::string directory() const;
+	// value of a shell variable, or else environment variable, "" when it is not set
+	std::string variable(const std::string& name) const;
+	void setVariable(const std::string& name, const std::string& value);
+
+private:
+	std::unique_ptr<Session> state;
+};
+
+#if SHELL_COROUTINES
+inline void ShellAwaitable::await_suspend(std::coroutine_handle<> handle) {
+	shell->submit(expression, [this, handle](ShellResult& completed) {
+		result = std::move(completed);
+		handle.resume();
+	});
+}
+#endif
@@ -1,11 +1,19 @@
 #include <gtest/gtest.h>
 #include <stdlib.h>
 #include <fcntl.h>
+#include <chrono>
+#include <dirent.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+#include "shell.h"
+#include "jumpindex.h"
 
 using namespace std;
 
 // shell to run tests on
-#define SHELL "../build/shell -t"
+#define SHELL_BINARY "../build/shell"
+#define SHELL SHELL_BINARY " -t"
 //#define SHELL "/bin/sh"
 
 // declarations of methods you want to test (should match exactly)
@@ -14,6 +22,9 @@ vector<string> splitString(const string& str, char delimiter = ' ');
 namespace {
 
 void Execute(std::string command, std::string expectedOutput);
+size_t openFds();
+std::string filecontents(const std::string& str);
+void filewrite(const std::string& str, std::string content);
 void Execute(std::string command, std::string expectedOutput, std::string expectedOutputFile, std::string expectedOutputFileContent);
 
 TEST(Shell, splitString) {
@@ -109,6 +120,313 @@ TEST(Shell, goodErrors){
 	Execute("pwd > 1", "opening file error for output\n File exists");
 }
 
+TEST(Shell, timeoutStage){
+	auto start = std::chrono::steady_clock::now();
+	Execute("timeout 200ms sleep 5", "");
+	EXPECT_LT(std::chrono::steady_clock::now() - start, std::chrono::seconds(2));
+
+	// what the stage started goes too, it would keep the output pipe open otherwise
+	filewrite("../forks.sh", "sleep 5; echo done\n");
+	Shell shell;
+	start = std::chrono::steady_clock::now();
+	EXPECT_EQ(124, shell.run("cd ../test-dir\ntimeout 100ms sh ../forks.sh").status);
+	EXPECT_EQ("[]\n", shell.run("echo [$(timeout 100ms sh ../forks.sh)]").out);
+	EXPECT_LT(std::chrono::steady_clock::now() - start, std::chrono::seconds(2));
+	unlink("../forks.sh");
+}
+
+TEST(Shell, deadlineExpression){
+	auto start = std::chrono::steady_clock::now();
+	Execute("deadline 200ms\nsleep 5 | sleep 5\nmetrics",
+		"pipelines: 1\nstages: 2\nstage timeouts: 0\nexpired deadlines: 1\nkills: 0\n");
+	EXPECT_LT(std::chrono::steady_clock::now() - start, std::chrono::seconds(2));
+}
+
+TEST(Shell, commandSubstitution){
+	Execute("ls $(echo -1) | head -n `echo 2`", "1\n2\n");
+	Execute("echo x$(printf a\\nb\\n\\n)y", "xa by\n");
+	Execute("echo $(echo $(echo nested) twice) $(true)", "nested twice\n");
+	// a substitution runs in a subshell, internal commands don't change the shell
+	Execute("echo [$(cd /; pwd)]; ls | head -n 1", "[/]\n1\n");
+	Execute("a=1; echo [$(exit; echo no)] $(a=2; echo $a) $a [$(deadline 1s; deadline)]; deadline",
+		"[] 2 1 [deadline 1000ms]\nno deadline\n");
+}
+
+TEST(Shell, backgroundJobLog){
+	unlink("../foobar");
+	Shell shell;
+	shell.run("cd ../test-dir\njoblog on\nseq 1 3 &\nls -1 doesntExist &");
+	// poll the job list until both jobs are done, rather than sleeping for a guessed while
+	std::string jobs = shell.run("joblog").out;
+	for (int i = 0; i < 500 && jobs.find("running") != std::string::npos; ++i) {
+		usleep(10000);
+		jobs = shell.run("joblog").out;
+	}
+	EXPECT_EQ(std::string::npos, jobs.find("running")) << jobs;
+	EXPECT_EQ("1\n2\n3\n", shell.run("joblog 1").out);
+	shell.run("joblog 2 ../foobar");
+	EXPECT_EQ("ls: cannot access 'doesntExist': No such file or directory\n", filecontents("../foobar"));
+	unlink("../foobar");
+}
+
+TEST(Shell, jobLogDoesntHoldUpReadInput){
+	// the shell reads all three lines at once, the last one must run without waiting for more input or the job
+	unlink("../marker");
+	FILE* shell = popen("cd ../test-dir; (printf 'joblog on\\nsleep 3 &\\ntouch ../marker\\n'; sleep 2) | " SHELL, "r");
+	auto start = std::chrono::steady_clock::now();
+	struct stat st;
+	while (stat("../marker", &st) != 0 && std::chrono::steady_clock::now() - start < std::chrono::seconds(1)) {
+		usleep(10000);
+	}
+	EXPECT_EQ(0, stat("../marker", &st));
+	pclose(shell);
+	unlink("../marker");
+}
+
+TEST(Shell, controlFlow){
+	Execute("i=0; while [ $i -lt 3 ]; do echo $i; i=$((i+1)); done", "0\n1\n2\n");
+	Execute("for f in $(ls); do if [ $f = 2 ]; then echo two; elif test $f -gt 2; then echo big; else echo small; fi; done",
+		"small\ntwo\nbig\nbig\n");
+	Execute("false && echo no || echo yes; true && echo $(( (1 + 2) * 3 % 5 ))", "yes\n4\n");
+	Execute("n=3\nuntil [ $n -eq 0 ]\ndo\n  n=$((n-1))\ndone\necho $n", "0\n");
+	Execute("n=-12; echo $(( 0x10 + 010 + n )); [ 0100 -eq 100 ] && echo decimal", "12\ndecimal\n");
+	// what the builtins don't handle themselves is left to the programs
+	Execute("ln -s 1 link; [ -L link ] && test 1 -eq 1 -a link -ef 1 && echo -e a\\tb; echo -n -n x; rm link",
+		"a\tb\nx");
+	Execute("[ x -eq 1 ]; echo $?; [ 2 -nt doesntExist ] && echo -e a\\tb | cat", "2\na\tb\n");
+	// overflow wraps around instead of crashing the shell
+	Execute("m=$(( -9223372036854775807 - 1 )); echo $(( m / -1 )) $(( m % -1 )) $(( m - 1 )) $(( -m ))",
+		"-9223372036854775808 0 9223372036854775807 -9223372036854775808\n");
+}
+
+TEST(Shell, loopsDontFork){
+	auto start = std::chrono::steady_clock::now();
+	Execute("i=0; while [ $i -lt 100000 ]; do i=$((i+1)); done; echo $i\nmetrics",
+		"100000\npipelines: 0\nstages: 0\nstage timeouts: 0\nexpired deadlines: 0\nkills: 0\n");
+	EXPECT_LT(std::chrono::steady_clock::now() - start, std::chrono::seconds(1));
+}
+
+TEST(Shell, optimizer){
+	Execute("explain cat 1 | cat | head -n 2",
+		"original:  cat 1 | cat | head -n 2\n"
+		"optimized: head -n 2 < 1\n"
+		"- dropped the 'cat' in the middle of the pipeline\n"
+		"- 'cat 1 |' became '< 1'\n");
+	Execute("cat 1 | cat | head -n 2", "line 1\nline 2\n");
+	Execute("echo a b | cat | wc -w", "2\n");
+	Execute("optimize off\nexplain cat 1 | cat\noptimize",
+		"original:  cat 1 | cat\noptimized: cat 1 | cat\n- optimize is off\noptimize off\n");
+	// cat has to report a file it can't open
+	Execute("cat nonexistent | wc -l", "0\n");
+	// only builtin stages whose arguments the builtin handles skip the exec
+	Execute("explain echo a | echo -e b",
+		"original:  echo a | echo -e b\n"
+		"optimized: echo a | echo -e b\n"
+		"- 'echo' runs as builtin in its child, without exec\n");
+}
+
+TEST(Shell, headStopsUpstream){
+	auto start = std::chrono::steady_clock::now();
+	Execute("sleep 5 | head -n 0", "");
+	EXPECT_LT(std::chrono::steady_clock::now() - start, std::chrono::seconds(2));
+
+	// a stage that may do more than writing output runs to its end
+	filewrite("/tmp/shelltest-side.sh", "echo x; sleep 0.3; touch /tmp/shelltest-marker\n");
+	unlink("/tmp/shelltest-marker");
+	Execute("sh /tmp/shelltest-side.sh | head -n 1", "x\n");
+	EXPECT_EQ(0, access("/tmp/shelltest-marker", F_OK));
+	unlink("/tmp/shelltest-marker");
+	unlink("/tmp/shelltest-side.sh");
+}
+
+TEST(Shell, libraryInterface){
+	char buffer[512];
+	std::string cwd = getcwd(buffer, sizeof(buffer));
+	Shell shell;
+	ShellResult result = shell.run("cd ../test-dir\ncat 1 | head -n 1; ls nonexistent; echo $?");
+	EXPECT_EQ("line 1\n2\n", result.out);
+	EXPECT_NE("", result.err);
+	// (the optimizer turned 'cat 1 | head -n 1' into 'head -n 1 < 1')
+	ASSERT_EQ(2u, result.stages.size());
+	EXPECT_EQ(std::vector<std::string>({ "ls", "nonexistent" }), result.stages[1].command);
+	EXPECT_EQ(2, result.stages[1].status);
+	EXPECT_GT(result.stages[0].usage.ru_maxrss, 0);
+	EXPECT_EQ(0, result.status);
+	// the session has its own directory, the process keeps its own
+	EXPECT_EQ(cwd, getcwd(buffer, sizeof(buffer)));
+	EXPECT_EQ(cwd.substr(0, cwd.rfind('/')) + "/test-dir", shell.directory());
+
+	result = shell.run("a=1; exit; a=2");
+	EXPECT_TRUE(result.exited);
+	EXPECT_EQ("1", shell.variable("a"));
+
+	// sessions don't share anything
+	Shell other;
+	other.setVariable("a", "other");
+	EXPECT_EQ("other\n", other.run("echo $a").out);
+	EXPECT_EQ("1\n", shell.run("echo $a").out);
+
+	result = shell.run(parseCommandLine("timeout 50ms sleep 1"));
+	EXPECT_EQ(124, result.status);
+
+	// (the session is still in test-dir, where 1 is a file that isn't executable)
+	EXPECT_EQ(127, shell.run("nonexistentcmd").status);
+	EXPECT_EQ(126, shell.run("./1").status);
+	EXPECT_EQ("126\n", shell.run("./1 | cat; ./1; echo $?").out);
+
+	std::string error;
+	EXPECT_TRUE(parseCommandLine("echo a |", &error).commands.empty());
+	EXPECT_NE("", error);
+}
+
+TEST(Shell, pollDrainsJobs){
+	Shell shell;
+	shell.run("seq 1 300000 &");
+	// far more output than its pipe holds, the job only finishes when poll() keeps draining it
+	std::string jobs;
+	for (int i = 0; i < 300 && jobs.find("done") == std::string::npos; ++i) {
+		shell.poll();
+		usleep(10000);
+		if (i % 50 == 49) {
+			jobs = shell.run("joblog").out;
+		}
+	}
+	EXPECT_EQ("[1] done 0, 1988895 bytes logged\tseq 1 300000 &\n", jobs);
+	EXPECT_EQ(size_t(0), shell.pending());
+}
+
+TEST(Shell, thousandsOfSubmittedPipelines){
+	// each pipeline holds 3 or 4 fds while it is in flight
+	struct rlimit limit;
+	getrlimit(RLIMIT_NOFILE, &limit);
+	limit.rlim_cur = limit.rlim_max;
+	setrlimit(RLIMIT_NOFILE, &limit);
+	size_t fdsBefore = openFds();
+
+	const int PIPELINES = 5000;
+	int completed = 0, correct = 0;
+	{
+		Shell shell;
+		for (int i = 0; i < PIPELINES; i++) {
+			std::string number = std::to_string(i);
+			// every fifth one has two stages
+			Expression expression = parseCommandLine("/bin/echo " + number + (i % 5 == 0 ? " | /bin/cat" : ""));
+			shell.submit(expression, [&completed, &correct, number](ShellResult& result) {
+				completed++;
+				correct += result.status == 0 && result.out == number + "\n" && result.err.empty();
+			});
+		}
+		// all of them are in flight at once, nothing has been reaped yet
+		EXPECT_EQ(size_t(PIPELINES), shell.pending());
+		while (shell.poll() > 0) {
+		}
+		EXPECT_EQ(size_t(1), openFds() - fdsBefore); // the epoll instance
+	}
+	EXPECT_EQ(PIPELINES, completed);
+	EXPECT_EQ(PIPELINES, correct);
+	EXPECT_EQ(fdsBefore, openFds());
+	// no zombies, or children at all, are left behind
+	EXPECT_EQ(-1, waitpid(-1, nullptr, WNOHANG));
+	EXPECT_EQ(ECHILD, errno);
+}
+
+TEST(Shell, submitTimeoutAndBuiltin){
+	Shell shell;
+	std::vector<int> statuses;
+	shell.submit(parseCommandLine("timeout 50ms sleep 5"), [&](ShellResult& result) { statuses.push_back(result.status); });
+	shell.submit(parseCommandLine("false"), [&](ShellResult& result) { statuses.push_back(result.status); });
+	auto start = std::chrono::steady_clock::now();
+	while (shell.poll() > 0) {
+	}
+	EXPECT_LT(std::chrono::steady_clock::now() - start, std::chrono::seconds(2));
+	// the builtin ran in the shell and completes first
+	EXPECT_EQ(std::vector<int>({ 1, 124 }), statuses);
+}
+
+TEST(Shell, commandOption){
+	char buffer[512];
+	std::string dir = getcwd(buffer, sizeof(buffer));
+	std::string cmdstring = "cd ../test-dir; " SHELL_BINARY " -c 'echo first; cat 1 | head -n 1; false' > '" + dir + "/output' 2> /dev/null";
+	int status = system(cmdstring.c_str());
+	EXPECT_EQ("first\nline 1\n", filecontents("output"));
+	ASSERT_TRUE(WIFEXITED(status));
+	EXPECT_EQ(1, WEXITSTATUS(status));
+}
+
+TEST(Shell, jumpToDirectory){
+	char file[] = "/tmp/shelljumpsXXXXXX";
+	close(mkstemp(file));
+	const char* previous = getenv("SHELL_JUMP_DB");
+	std::string previousFile = previous != NULL ? previous : "";
+	setenv("SHELL_JUMP_DB", file, 1);
+	mkdir("../test-dir/gone-later", 0700);
+	{
+		Shell shell;
+		shell.run("cd ../test-dir; cd gone-later; cd /");
+		ShellResult result = shell.run("cd test");
+		std::string testDir = shell.directory();
+		EXPECT_EQ("test-dir", testDir.substr(testDir.rfind('/') + 1));
+		EXPECT_EQ(testDir + "\n", result.out);
+		EXPECT_EQ("", result.err);
+		EXPECT_EQ(testDir + "/gone-later\n", shell.run("cd gone").out);
+		// the directory that no longer exists is removed when it comes up
+		rmdir("../test-dir/gone-later");
+		EXPECT_EQ(3u, JumpIndex(file).size());
+		shell.run("cd /");
+		result = shell.run("cd gone");
+		EXPECT_EQ("", result.out);
+		EXPECT_NE("", result.err);
+		EXPECT_EQ("/", shell.directory());
+		EXPECT_EQ(2u, JumpIndex(file).size());
+		// scattered characters match too
+		EXPECT_EQ(testDir + "\n", shell.run("cd tstdr").out);
+		// a path that exists but isn't a directory is an error, not a fragment
+		filewrite("../tstdr", "");
+		shell.run("cd ..");
+		result = shell.run("cd tstdr");
+		EXPECT_EQ("", result.out);
+		EXPECT_NE("", result.err);
+		EXPECT_EQ(testDir.substr(0, testDir.rfind('/')), shell.directory());
+		// the same for the shell itself, which chdir()s
+		Execute("cd ..; cd test-dir; cd ..; cd tstdr; ls -d test-dir", "test-dir\n");
+		unlink("../tstdr");
+	}
+	if (previous != NULL) {
+		setenv("SHELL_JUMP_DB", previousFile.c_str(), 1);
+	}
+	else {
+		unsetenv("SHELL_JUMP_DB");
+	}
+	unlink(file);
+}
+
+TEST(Shell, jumpIndexConcurrentSessions){
+	char file[] = "/tmp/shelljumpsXXXXXX";
+	close(mkstemp(file));
+	// the processes grow the file (capacity starts at 1024 directories) while the others use it
+	const int PROCESSES = 4, PATHS = 1000;
+	for (int p = 0; p < PROCESSES; p++) {
+		if (fork() == 0) {
+			JumpIndex index(file);
+			for (int i = 0; i < PATHS; i++) {
+				index.record("/process" + std::to_string(p) + "/dir" + std::to_string(i));
+				index.record("/shared");
+			}
+			_exit(0);
+		}
+	}
+	int status;
+	while (wait(&status) > 0) {
+		EXPECT_EQ(0, status);
+	}
+	JumpIndex index(file);
+	EXPECT_EQ(size_t(PROCESSES * PATHS + 1), index.size());
+	std::vector<JumpMatch> matches = index.matches("dir999", 10);
+	ASSERT_EQ(size_t(PROCESSES), matches.size());
+	EXPECT_EQ("/shared", index.matches("shared", 10).at(0).path);
+	unlink(file);
+}
+
 /*==================================================*/
 
 //////////////// HELPERS
@@ -137,6 +455,17 @@ std::string filecontents(const std::string& str) {
 	return retval;
 }
 
+size_t openFds() {
+	size_t count = 0;
+	DIR* dir = opendir("/proc/self/fd");
+	while (dir != NULL && readdir(dir) != NULL) {
+		count++;
+	}
+	if (dir != NULL)
+		closedir(dir);
+	return count;
+}
+
 void filewrite(const std::string& str, std::string content) {
 	int fd = open(str.c_str(), O_WRONLY | O_TRUNC | O_CREAT, S_IRUSR | S_IWUSR);
 	if (fd < 0)
@@ -1,8 +1,20 @@
 #include <gtest/gtest.h>
+#include <stdlib.h>
+#include <unistd.h>
 
 int main(int argc, char** argv) {
 	::testing::InitGoogleTest(&argc, argv);
+	// every 'cd' records into the jump index, keep the tests out of the real ~/.shell_jumps
+	char jumps[] = "/tmp/shelltest-jumpsXXXXXX";
+	int fd = mkstemp(jumps);
+	if (fd >= 0) {
+		close(fd);
+		setenv("SHELL_JUMP_DB", jumps, 1);
+	}
 	int retval = RUN_ALL_TESTS();
+	if (fd >= 0) {
+		unsetenv("SHELL_JUMP_DB");
+		unlink(jumps);
+	}
 	return retval;
 }
-